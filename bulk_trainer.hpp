@@ -0,0 +1,199 @@
+#ifndef BULK_TRAINER_HPP
+#define BULK_TRAINER_HPP
+
+#include <map>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <sstream>
+#include <iomanip>
+#include <functional>
+#include "svm_cxx.hpp"
+
+// trains one one-class svm_cxx model per entity on all cores; entities are dealt
+// to per-thread queues largest first, and a thread whose queue runs dry steals
+// from the others, so a few huge entities do not leave the other threads idle
+class bulk_trainer {
+public:
+    typedef std::function<void(svm_cxx &)> init_function;
+
+    // init sets the parameters of every model (default: one_class_svm_param_init)
+    explicit bulk_trainer(int _nr_thread = 0, init_function _init = nullptr) :
+            nr_thread(_nr_thread),
+            init(std::move(_init)) {
+        nr_thread = svm_thread_num(nr_thread);
+        if (!init)
+            init = [](svm_cxx &svm) { svm.one_class_svm_param_init(); };
+    }
+
+    // one entity per distinct value of key_column, trained on all the other columns
+    int train(const dataframe<double> &dataset, const std::string &key_column, int nr_fold = 1) {
+        const auto &columns = dataset.get_column_str();
+        auto key = std::find(columns.begin(), columns.end(), key_column);
+        if (key == columns.end() || dataset.column_num() < 2)
+            return -1;
+        auto key_index = (unsigned long long int) (key - columns.begin());
+
+        std::map<double, std::vector<unsigned long long int>> groups;
+        const auto &keys = dataset(key_index).get_std_vector();
+        for (unsigned long long int i = 0; i < dataset.row_num(); ++i)
+            groups[keys[i]].push_back(i);
+
+        std::vector<std::string> feature_columns;
+        for (unsigned long long int d = 0; d < dataset.column_num(); ++d)
+            if (d != key_index)
+                feature_columns.push_back(columns[d]);
+
+        std::vector<dataframe<double>> datasets;
+        std::vector<std::string> names;
+        std::vector<double> row(feature_columns.size());
+        for (const auto &group : groups) {
+            dataframe<double> part(feature_columns);
+            for (const auto &i : group.second) {
+                for (unsigned long long int d = 0, k = 0; d < dataset.column_num(); ++d)
+                    if (d != key_index)
+                        row[k++] = dataset(d)[i];
+                part.append(row);
+            }
+            datasets.push_back(std::move(part));
+            std::ostringstream name;
+            name << std::setprecision(17) << group.first;
+            names.push_back(name.str());
+        }
+        return train(datasets, names, nr_fold);
+    }
+
+    // one entity per dataframe, named after its position in the list unless names are given
+    int train(const std::vector<dataframe<double>> &datasets, std::vector<std::string> names = {},
+              int nr_fold = 1) {
+        if (!names.empty() && names.size() != datasets.size())
+            return -1;
+        for (unsigned long long int i = names.size(); i < datasets.size(); ++i)
+            names.push_back(std::to_string(i));
+
+        entity_names = std::move(names);
+        models.clear();
+        accuracy.assign(datasets.size(), -1);
+        for (const auto &item : datasets) {
+            models.emplace_back(new svm_cxx(int(item.column_num())));
+            init(*models.back());
+            models.back()->set_nr_thread(1);	// the entities already use all threads
+        }
+
+        std::vector<unsigned long long int> cost(datasets.size());
+        for (unsigned long long int i = 0; i < datasets.size(); ++i)
+            cost[i] = datasets[i].row_num() * datasets[i].row_num();
+
+        // a workspace per thread: after the first few entities training no longer allocates
+        std::vector<struct svm_workspace *> workspace(nr_thread);
+        for (auto &item : workspace)
+            item = svm_create_workspace();
+        work_stealing_for(cost, nr_thread, [&](int i, int thread) {
+            models[i]->set_workspace(workspace[thread]);
+            // an exception escaping a worker thread would terminate the process: fail the entity instead
+            try {
+                accuracy[i] = models[i]->train(datasets[i], {}, nr_fold);
+            } catch (...) {
+                accuracy[i] = -1;
+            }
+            models[i]->set_workspace(nullptr);
+        });
+        for (auto &item : workspace)
+            svm_destroy_workspace(item);
+
+        int failed = 0;
+        for (const auto &item : accuracy)
+            if (item < 0)
+                ++failed;
+        return failed;
+    }
+
+    // write every model to directory/<entity name> in parallel; returns the number of failures
+    int save_models(const std::string &directory) {
+        std::vector<unsigned long long int> cost(models.size());
+        for (unsigned long long int i = 0; i < models.size(); ++i)
+            cost[i] = models[i]->sv_num();
+        std::atomic<int> failed(0);
+        work_stealing_for(cost, nr_thread, [&](int i, int) {
+            if (models[i]->save_model(directory + "/" + entity_names[i]) != 0)
+                ++failed;
+        });
+        return failed;
+    }
+
+    [[nodiscard]] unsigned long long int model_num() const {
+        return models.size();
+    }
+
+    [[nodiscard]] const std::string &entity_name(unsigned long long int i) const {
+        return entity_names.at(i);
+    }
+
+    // training accuracy of entity i as returned by svm_cxx::train, -1 if it failed
+    [[nodiscard]] double get_accuracy(unsigned long long int i) const {
+        return accuracy.at(i);
+    }
+
+    svm_cxx &get_model(unsigned long long int i) {
+        return *models.at(i);
+    }
+
+private:
+    int nr_thread;
+    init_function init;
+    std::vector<std::string> entity_names;
+    std::vector<std::unique_ptr<svm_cxx>> models;
+    std::vector<double> accuracy;
+
+    // run task(i, thread) for every i < cost.size() on nr_thread threads; each thread owns a queue
+    // dealt largest cost first and takes from its front, a thread with an empty queue steals from
+    // the back of the others
+    template<typename F>
+    static void work_stealing_for(const std::vector<unsigned long long int> &cost, int nr_thread, F &&task) {
+        int n = int(cost.size());
+        nr_thread = std::max(1, std::min(nr_thread, n));
+        std::vector<int> order(n);
+        for (int i = 0; i < n; ++i)
+            order[i] = i;
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return cost[a] > cost[b]; });
+
+        std::vector<std::deque<int>> queue(nr_thread);
+        std::vector<std::mutex> lock(nr_thread);
+        for (int i = 0; i < n; ++i)
+            queue[i % nr_thread].push_back(order[i]);
+
+        auto worker = [&](int thread) {
+            while (true) {
+                int i = -1;
+                {
+                    std::lock_guard<std::mutex> guard(lock[thread]);
+                    if (!queue[thread].empty()) {
+                        i = queue[thread].front();
+                        queue[thread].pop_front();
+                    }
+                }
+                for (int k = 1; i < 0 && k < nr_thread; ++k) {
+                    int victim = (thread + k) % nr_thread;
+                    std::lock_guard<std::mutex> guard(lock[victim]);
+                    if (!queue[victim].empty()) {
+                        i = queue[victim].back();
+                        queue[victim].pop_back();
+                    }
+                }
+                if (i < 0)
+                    return;
+                task(i, thread);
+            }
+        };
+        std::vector<std::thread> workers;
+        for (int t = 1; t < nr_thread; ++t)
+            workers.emplace_back(worker, t);
+        worker(0);
+        for (auto &item : workers)
+            item.join();
+    }
+};
+
+#endif //BULK_TRAINER_HPP
@@ -52,7 +52,7 @@ class dataframe;
 
 template<typename T = double>
 class scaler {
-    T transform(const T &value, std::pair<T, T> param) {
+    T transform(const T &value, std::pair<T, T> param) const {
         return (value - param.first) / param.second;
     }
 
@@ -73,7 +73,7 @@ public:
         std::cout << "{" << scaler_array.back().first << "," << scaler_array.back().second << "}";
     }
 
-    void transform(dataframe<T> &dataset) {
+    void transform(dataframe<T> &dataset) const {
         for (unsigned long long int i = 0; i < dataset.column_num(); ++i) {
             for (unsigned long long int j = 0; j < dataset.row_num(); ++j) {
                 dataset(i)[j] = transform(dataset(i)[j], scaler_array[i]);
@@ -82,20 +82,20 @@ public:
         dataset.set_scaler_flag(true);
     }
 
-    dataframe<T> transform_copy(const dataframe<T> &dataset) {
+    dataframe<T> transform_copy(const dataframe<T> &dataset) const {
         dataframe<T> dataset_copy(dataset);
         transform(dataset_copy);
         dataset_copy.set_scaler_flag(true);
         return std::move(dataset_copy);
     }
 
-    void transform(std::vector<T> &data) {
+    void transform(std::vector<T> &data) const {
         for (unsigned long long int i = 0; i < data.size(); ++i) {
             data[i] = transform(data[i], scaler_array[i]);
         }
     }
 
-    std::vector<T> transform_copy(const std::vector<T> &data) {
+    std::vector<T> transform_copy(const std::vector<T> &data) const {
         std::vector<T> data_copy(data);
         transform(data_copy);
         return std::move(data_copy);
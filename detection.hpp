@@ -1,45 +1,105 @@
 #ifndef DETECTION_HPP
 #define DETECTION_HPP
 
+#include <memory>
 #include "svm_cxx.hpp"
 
 template<typename data_type = double,
         template<typename> class scaler_type = standard_scaler>
 class detection {
+    struct compiled_deleter {
+        void operator()(struct svm_compiled_model *cm) const {
+            svm_free_compiled_model(&cm);
+        }
+    };
+
     scaler_type<data_type> user_scaler;
-    svm_cxx one_class_svm;
+    std::shared_ptr<const svm_cxx> one_class_svm;
+    // the RBF model with the scaler folded in, scoring raw rows in one pass (null if not foldable)
+    std::unique_ptr<struct svm_compiled_model, compiled_deleter> fused;
+
+    [[nodiscard]] bool use_fused(const std::vector<data_type> &data) const {
+        return fused != nullptr && data.size() == user_scaler.scaler_array.size();
+    }
+
+    // data scaled into a per-thread buffer, data itself is left as it is
+    const std::vector<data_type> &scaled(const std::vector<data_type> &data) const {
+        thread_local std::vector<data_type> buffer;
+        buffer.assign(data.begin(), data.end());
+        user_scaler.transform(buffer);
+        return buffer;
+    }
+
 public:
     detection(int feature_num, const std::string &model_filename, const std::string &scaler_filename) :
             user_scaler(scaler_filename),
-            one_class_svm(feature_num, model_filename) {
+            one_class_svm(std::make_shared<svm_cxx>(feature_num, model_filename)),
+            fused(one_class_svm->compile_scaled(user_scaler.scaler_array)) {
     }
 
-    std::pair<double,data_type> predict(std::vector<data_type> &data, bool trans = true) {
-        if (trans){
-            user_scaler.transform(data);
+    // several detections (one per thread, or per scaler) can score with one loaded model
+    detection(std::shared_ptr<const svm_cxx> model, const std::string &scaler_filename) :
+            user_scaler(scaler_filename),
+            one_class_svm(std::move(model)),
+            fused(one_class_svm->compile_scaled(user_scaler.scaler_array)) {
+    }
+
+    [[nodiscard]] std::shared_ptr<const svm_cxx> get_model() const {
+        return one_class_svm;
+    }
+
+    // const and reentrant: concurrent calls on one detection are safe. With trans, RBF models score
+    // the raw row on the fused model instead of scaling a copy of it first
+    std::pair<double,data_type> predict(const std::vector<data_type> &data, bool trans = true) const {
+        if (trans && use_fused(data)) {
+            double dec_value;
+            double label = svm_compiled_predict_values(fused.get(), data.data(), int(data.size()), &dec_value);
+            return {label, dec_value};
         }
-        return std::move(one_class_svm.predict(data));
+        return one_class_svm->predict(trans ? scaled(data) : data);
+    }
+
+    // label only, the exact decision value is not computed
+    double predict_label(const std::vector<data_type> &data, bool trans = true) const {
+        if (trans && use_fused(data))
+            return svm_compiled_predict_label(fused.get(), data.data(), int(data.size()));
+        return one_class_svm->predict_label(trans ? scaled(data) : data);
     }
 
-    double validation(dataframe<data_type> &dataset, bool trans = true) {
+    double validation(dataframe<data_type> &dataset, bool trans = true) const {
         if (trans && !dataset.get_scaler_flag()){
             user_scaler.transform(dataset);
         }
-        return one_class_svm.clf_validation(dataset);
+        return one_class_svm->clf_validation(dataset);
     }
 
-    void validation(const dataframe<data_type> &dataset, const std::string & filename, bool trans = true) {
+    // rows are scored in parallel, each through predict() from a per-thread row buffer (so with trans
+    // on the fused model, or scaled row by row), and written in their original order
+    void validation(const dataframe<data_type> &dataset, const std::string & filename, bool trans = true) const {
         std::vector<std::string> column_strs = dataset.get_column_str();
         column_strs.emplace_back("result");
         column_strs.emplace_back("dec_value");
         dataframe<data_type> save_file(column_strs);
-        for (int i = 0; i < dataset.row_num(); ++i) {
+        auto row_num = (long long int) dataset.row_num();
+        std::vector<std::pair<double, data_type>> result(row_num);
+        int nr_thread = one_class_svm->thread_num();
+        int nr_block = int(std::min<long long int>(row_num, nr_thread * 4LL));
+        auto score = [&](int b) {
+            thread_local std::vector<data_type> row;
+            row.resize(dataset.column_num());
+            for (long long int i = b * row_num / nr_block; i < (b + 1) * row_num / nr_block; ++i) {
+                for (unsigned long long int j = 0; j < row.size(); ++j)
+                    row[j] = dataset(j)[i];
+                result[i] = predict(row, trans);
+            }
+        };
+        svm_parallel_for(nr_block, nr_thread, [](int b, int, void *arg) { (*static_cast<decltype(score) *>(arg))(b); },
+                         (void *) &score);
+        for (unsigned long long int i = 0; i < result.size(); ++i) {
             std::vector<data_type> data = dataset[i].get_std_vector();
-            std::vector<data_type> data_backup = data;
-            std::pair<double,data_type> result = this->predict(data,trans);
-            data_backup.emplace_back(result.first);
-            data_backup.emplace_back(result.second);
-            save_file.append(data_backup);
+            data.emplace_back(result[i].first);
+            data.emplace_back(result[i].second);
+            save_file.append(data);
         }
         save_file.to_csv(filename);
     }
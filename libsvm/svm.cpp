@@ -4,9 +4,16 @@
 #include <ctype.h>
 #include <float.h>
 #include <string.h>
+#include <stdint.h>
 #include <stdarg.h>
 #include <limits.h>
 #include <locale.h>
+#include <algorithm>
+#include <atomic>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
 #include "svm.h"
 int libsvm_version = LIBSVM_VERSION;
 typedef float Qfloat;
@@ -23,17 +30,47 @@ template <class S, class T> static inline void clone(T*& dst, S* src, int n)
     dst = new T[n];
     memcpy((void *)dst,(void *)src,sizeof(T)*n);
 }
-static inline double powi(double base, int times)
+
+int svm_thread_num(int nr_thread)
 {
-    double tmp = base, ret = 1.0;
+    if(nr_thread > 0)
+        return nr_thread;
+    return max(1,(int)std::thread::hardware_concurrency());
+}
 
-    for(int t=times; t>0; t/=2)
+// run f(i,t) for i = 0, ..., n-1 on up to nr_thread threads (0: all cores); each thread takes the
+// next i as soon as it is free, t < nr_thread is the thread that runs it
+template <class F> static void parallel_for_thread(int n, int nr_thread, F f)
+{
+    nr_thread = min(svm_thread_num(nr_thread),n);
+    if(nr_thread <= 1)
     {
-        if(t%2==1) ret*=tmp;
-        tmp = tmp * tmp;
+        for(int i=0;i<n;i++)
+            f(i,0);
+        return;
     }
-    return ret;
+    std::atomic<int> next(0);
+    std::thread *workers = new std::thread[nr_thread];
+    for(int t=0;t<nr_thread;t++)
+        workers[t] = std::thread([&,t]() {
+            for(int i=next++;i<n;i=next++)
+                f(i,t);
+        });
+    for(int t=0;t<nr_thread;t++)
+        workers[t].join();
+    delete[] workers;
+}
+
+template <class F> static void parallel_for(int n, int nr_thread, F f)
+{
+    parallel_for_thread(n,nr_thread,[&](int i, int) { f(i); });
+}
+
+void svm_parallel_for(int n, int nr_thread, void (*f)(int i, int thread, void *arg), void *arg)
+{
+    parallel_for_thread(n,nr_thread,[&](int i, int t) { f(i,t,arg); });
 }
+
 #define INF HUGE_VAL
 #define TAU 1e-12
 #define Malloc(type,n) (type *)malloc((n)*sizeof(type))
@@ -58,22 +95,65 @@ static void info(const char *fmt,...)
 static void info(const char *fmt,...) {}
 #endif
 
+//
+// Training and prediction workspace
+//
+// grow-only buffers that a sequence of trainings or predictions on one thread can share,
+// so that once they are large enough a solve or a prediction does not touch the heap
+//
+struct svm_workspace
+{
+    enum { P, Y, ALPHA, ALPHA_STATUS, ACTIVE_SET, G, G_BAR, ZEROS, ONES, TRAIN_ALPHA, LOO_ALPHA,
+           X, X_SQUARE, ROW, QD, CACHE_HEAD, CACHE_DATA, CACHE_FREE,
+           DEC_VALUES, KVALUE, START, VOTE, FGT_DX, FGT_HEADS, FGT_MONOMIAL,
+           PAIRWISE_PROB, PROB_Q, PROB_QP, QUANT_X, NR_BUFFER };
+    void *buffer[NR_BUFFER];
+    size_t size[NR_BUFFER];
+};
+
+// ws == NULL: plain new[], released by ws_release
+template <class T> static T *ws_alloc(svm_workspace *ws, int b, long int n)
+{
+    if(ws == NULL)
+        return new T[n];
+    size_t bytes = sizeof(T)*(size_t)max(n,1L);
+    if(ws->size[b] < bytes)
+    {
+        free(ws->buffer[b]);
+        ws->buffer[b] = malloc(bytes);
+        ws->size[b] = bytes;
+    }
+    return (T *)ws->buffer[b];
+}
+template <class T> static void ws_release(svm_workspace *ws, T *p)
+{
+    if(ws == NULL)
+        delete[] p;
+}
+template <class S, class T> static inline void ws_clone(svm_workspace *ws, int b, T*& dst, S* src, int n)
+{
+    dst = ws_alloc<T>(ws,b,n);
+    memcpy((void *)dst,(void *)src,sizeof(T)*n);
+}
+
 //
 // Kernel Cache
 //
 // l is the number of total data items
 // size is the cache size limit in bytes
+// ws != NULL: the cache is a fixed set of full-length column slots taken from ws
 //
 class Cache
 {
 public:
-    Cache(int l,long int size);
+    Cache(int l,long int size,svm_workspace *ws = NULL);
     ~Cache();
 
     // request data [0,len)
     // return some position p where [p,len) need to be filled
     // (p >= len if nothing needs to be filled)
     int get_data(const int index, Qfloat **data, int len);
+    bool has_data(const int index, int len) const { return head[index].len >= len; }
     void swap_index(int i, int j);
 private:
     int l;
@@ -89,24 +169,63 @@ private:
     head_t lru_head;
     void lru_delete(head_t *h);
     void lru_insert(head_t *h);
+
+    // slot mode
+    svm_workspace *ws;
+    Qfloat **free_slot;	// stack of unused slots
+    int nr_free;
+    void release(head_t *h);
 };
 
-Cache::Cache(int l_,long int size_):l(l_),size(size_)
+Cache::Cache(int l_,long int size_,svm_workspace *ws_):l(l_),size(size_),ws(ws_)
 {
-    head = (head_t *)calloc(l,sizeof(head_t));	// initialized to 0
+    if(ws)
+    {
+        head = ws_alloc<head_t>(ws,svm_workspace::CACHE_HEAD,l);
+        memset(head,0,sizeof(head_t)*l);
+    }
+    else
+        head = (head_t *)calloc(l,sizeof(head_t));	// initialized to 0
     size /= sizeof(Qfloat);
     size -= l * sizeof(head_t) / sizeof(Qfloat);
     size = max(size, 2 * (long int) l);	// cache must be large enough for two columns
     lru_head.next = lru_head.prev = &lru_head;
+
+    free_slot = NULL;
+    nr_free = 0;
+    if(ws)
+    {
+        nr_free = (int)min(size / max(l,1), (long int)l);
+        Qfloat *data = ws_alloc<Qfloat>(ws,svm_workspace::CACHE_DATA,(long int)nr_free*l);
+        free_slot = ws_alloc<Qfloat *>(ws,svm_workspace::CACHE_FREE,nr_free);
+        for(int k=0;k<nr_free;k++)
+            free_slot[k] = &data[(long int)k*l];
+    }
 }
 
 Cache::~Cache()
 {
+    if(ws)
+        return;
     for(head_t *h = lru_head.next; h != &lru_head; h=h->next)
         free(h->data);
     free(head);
 }
 
+// drop the cached column of h (h must not be in the LRU list)
+void Cache::release(head_t *h)
+{
+    if(ws)
+        free_slot[nr_free++] = h->data;
+    else
+    {
+        free(h->data);
+        size += h->len;
+    }
+    h->data = 0;
+    h->len = 0;
+}
+
 void Cache::lru_delete(head_t *h)
 {
     // delete from current location
@@ -129,17 +248,29 @@ int Cache::get_data(const int index, Qfloat **data, int len)
     if(h->len) lru_delete(h);
     int more = len - h->len;
 
-    if(more > 0)
+    if(more > 0 && ws)
+    {
+        // every slot holds a full column
+        if(h->data == 0)
+        {
+            if(nr_free == 0)
+            {
+                head_t *old = lru_head.next;
+                lru_delete(old);
+                release(old);
+            }
+            h->data = free_slot[--nr_free];
+        }
+        swap(h->len,len);
+    }
+    else if(more > 0)
     {
         // free old space
         while(size < more)
         {
             head_t *old = lru_head.next;
             lru_delete(old);
-            free(old->data);
-            size += old->len;
-            old->data = 0;
-            old->len = 0;
+            release(old);
         }
 
         // allocate new space
@@ -175,10 +306,7 @@ void Cache::swap_index(int i, int j)
             {
                 // give up
                 lru_delete(h);
-                free(h->data);
-                size += h->len;
-                h->data = 0;
-                h->len = 0;
+                release(h);
             }
         }
     }
@@ -197,11 +325,20 @@ public:
     virtual double *get_QD() const = 0;
     virtual void swap_index(int i, int j) const = 0;
     virtual ~QMatrix() {}
+
+    // for the solver's column prefetch (the defaults turn it off):
+    // compute_Q may run on another thread and must not touch the cache,
+    // put_Q stores a column computed by compute_Q into the cache
+    virtual bool is_cached(int, int) const { return true; }
+    virtual void compute_Q(int, int, Qfloat *) const {}
+    virtual void put_Q(int, int, const Qfloat *) const {}
 };
 
 class Kernel: public QMatrix {
 public:
-    Kernel(int l, svm_node * const * x, const svm_parameter& param);
+    Kernel(int l, svm_node * const * x, const svm_parameter& param, svm_workspace *ws = NULL);
+    Kernel(const svm_problem& prob, const svm_parameter& param, svm_workspace *ws = NULL);
+    Kernel(const svm_dense_problem& prob, const svm_parameter& param, svm_workspace *ws = NULL);
     virtual ~Kernel();
 
     static double k_function(const svm_node *x, const svm_node *y,
@@ -210,10 +347,12 @@ public:
     virtual double *get_QD() const = 0;
     virtual void swap_index(int i, int j) const	// no so const...
     {
-        swap(x[i],x[j]);
+        if(x) swap(x[i],x[j]);
+        else swap(row[i],row[j]);
         if(x_square) swap(x_square[i],x_square[j]);
     }
 protected:
+    svm_workspace *workspace;	// owner of the kernel's buffers if not NULL
 
     double (Kernel::*kernel_function)(int i, int j) const;
 
@@ -221,6 +360,11 @@ private:
     const svm_node **x;
     double *x_square;
 
+    // dense problems: feature d of instance i is column[d][row[i]]
+    const double * const *column;
+    int n;
+    int *row;
+
     // svm_parameter
     const int kernel_type;
     const int degree;
@@ -234,7 +378,7 @@ private:
     }
     double kernel_poly(int i, int j) const
     {
-        return powi(gamma*dot(x[i],x[j])+coef0,degree);
+        return svm_powi(gamma*dot(x[i],x[j])+coef0,degree);
     }
     double kernel_rbf(int i, int j) const
     {
@@ -248,36 +392,91 @@ private:
     {
         return x[i][(int)(x[j][0].value)].value;
     }
+
+    void set_kernel_function();
+    double dense_dot(int i, int j) const
+    {
+        int ri = row[i], rj = row[j];
+        double sum = 0;
+        for(int d=0;d<n;d++)
+            sum += column[d][ri]*column[d][rj];
+        return sum;
+    }
+    double kernel_linear_dense(int i, int j) const
+    {
+        return dense_dot(i,j);
+    }
+    double kernel_poly_dense(int i, int j) const
+    {
+        return svm_powi(gamma*dense_dot(i,j)+coef0,degree);
+    }
+    double kernel_rbf_dense(int i, int j) const
+    {
+        return exp(-gamma*(x_square[i]+x_square[j]-2*dense_dot(i,j)));
+    }
+    double kernel_sigmoid_dense(int i, int j) const
+    {
+        return tanh(gamma*dense_dot(i,j)+coef0);
+    }
 };
 
-Kernel::Kernel(int l, svm_node * const * x_, const svm_parameter& param)
-        :kernel_type(param.kernel_type), degree(param.degree),
-         gamma(param.gamma), coef0(param.coef0)
+void Kernel::set_kernel_function()
 {
     switch(kernel_type)
     {
         case LINEAR:
-            kernel_function = &Kernel::kernel_linear;
+            kernel_function = x ? &Kernel::kernel_linear : &Kernel::kernel_linear_dense;
             break;
         case POLY:
-            kernel_function = &Kernel::kernel_poly;
+            kernel_function = x ? &Kernel::kernel_poly : &Kernel::kernel_poly_dense;
             break;
         case RBF:
-            kernel_function = &Kernel::kernel_rbf;
+            kernel_function = x ? &Kernel::kernel_rbf : &Kernel::kernel_rbf_dense;
             break;
         case SIGMOID:
-            kernel_function = &Kernel::kernel_sigmoid;
+            kernel_function = x ? &Kernel::kernel_sigmoid : &Kernel::kernel_sigmoid_dense;
             break;
         case PRECOMPUTED:
             kernel_function = &Kernel::kernel_precomputed;
             break;
     }
+}
+
+Kernel::Kernel(const svm_problem& prob, const svm_parameter& param, svm_workspace *ws)
+        :Kernel(prob.l, prob.x, param, ws)
+{
+}
+
+Kernel::Kernel(const svm_dense_problem& prob, const svm_parameter& param, svm_workspace *ws)
+        :workspace(ws), x(0), column(prob.column), n(prob.n), kernel_type(param.kernel_type), degree(param.degree),
+         gamma(param.gamma), coef0(param.coef0)
+{
+    int l = prob.l;
+    row = ws_alloc<int>(ws,svm_workspace::ROW,l);
+    for(int i=0;i<l;i++)
+        row[i] = i;
+    set_kernel_function();
+
+    if(kernel_type == RBF)
+    {
+        x_square = ws_alloc<double>(ws,svm_workspace::X_SQUARE,l);
+        for(int i=0;i<l;i++)
+            x_square[i] = dense_dot(i,i);
+    }
+    else
+        x_square = 0;
+}
 
-    clone(x,x_,l);
+Kernel::Kernel(int l, svm_node * const * x_, const svm_parameter& param, svm_workspace *ws)
+        :workspace(ws), column(0), n(0), row(0), kernel_type(param.kernel_type), degree(param.degree),
+         gamma(param.gamma), coef0(param.coef0)
+{
+    ws_clone(ws,svm_workspace::X,x,x_,l);
+    set_kernel_function();
 
     if(kernel_type == RBF)
     {
-        x_square = new double[l];
+        x_square = ws_alloc<double>(ws,svm_workspace::X_SQUARE,l);
         for(int i=0;i<l;i++)
             x_square[i] = dot(x[i],x[i]);
     }
@@ -287,8 +486,9 @@ Kernel::Kernel(int l, svm_node * const * x_, const svm_parameter& param)
 
 Kernel::~Kernel()
 {
-    delete[] x;
-    delete[] x_square;
+    ws_release(workspace,x);
+    ws_release(workspace,x_square);
+    ws_release(workspace,row);
 }
 
 double Kernel::dot(const svm_node *px, const svm_node *py)
@@ -321,7 +521,7 @@ double Kernel::k_function(const svm_node *x, const svm_node *y,
         case LINEAR:
             return dot(x,y);
         case POLY:
-            return powi(param.gamma*dot(x,y)+param.coef0,param.degree);
+            return svm_powi(param.gamma*dot(x,y)+param.coef0,param.degree);
         case RBF:
         {
             double sum = 0;
@@ -372,6 +572,88 @@ double Kernel::k_function(const svm_node *x, const svm_node *y,
     }
 }
 
+//
+// Column prefetch
+//
+// a helper thread computes the column of Q the solver is likely to ask for
+// next, while the solver's thread updates the gradient; the column is put
+// into the cache by the solver's thread, so the cache is never shared
+//
+class Prefetcher {
+public:
+    Prefetcher(const QMatrix& Q, int l);
+    ~Prefetcher();
+    void start(int i, int len);
+    void finish();	// wait for the column started last and cache it
+private:
+    const QMatrix& Q;
+    Qfloat *buffer;
+    int column, len;
+    bool pending, started, stop;
+    std::mutex lock;
+    std::condition_variable cv;
+    std::thread worker;
+    void run();
+};
+
+Prefetcher::Prefetcher(const QMatrix& Q_, int l)
+        :Q(Q_), column(-1), len(0), pending(false), started(false), stop(false)
+{
+    buffer = new Qfloat[l];
+    worker = std::thread(&Prefetcher::run,this);
+}
+
+Prefetcher::~Prefetcher()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stop = true;
+    }
+    cv.notify_all();
+    worker.join();
+    delete[] buffer;
+}
+
+void Prefetcher::run()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    while(1)
+    {
+        cv.wait(guard,[this] { return pending || stop; });
+        if(stop)
+            return;
+        guard.unlock();
+        Q.compute_Q(column,len,buffer);
+        guard.lock();
+        pending = false;
+        cv.notify_all();
+    }
+}
+
+void Prefetcher::start(int i, int len_)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        column = i;
+        len = len_;
+        pending = true;
+        started = true;
+    }
+    cv.notify_all();
+}
+
+void Prefetcher::finish()
+{
+    if(!started)
+        return;
+    {
+        std::unique_lock<std::mutex> guard(lock);
+        cv.wait(guard,[this] { return !pending; });
+    }
+    started = false;
+    Q.put_Q(column,len,buffer);
+}
+
 // An SMO algorithm in Fan et al., JMLR 6(2005), p. 1889--1918
 // Solves:
 //
@@ -392,7 +674,8 @@ double Kernel::k_function(const svm_node *x, const svm_node *y,
 //
 class Solver {
 public:
-    Solver() {};
+    Solver(): keep_order(false), workspace(NULL), prefetch(false),
+              checkpoint_file(NULL), checkpoint_interval(0), checkpoint_hash(0) {};
     virtual ~Solver() {};
 
     struct SolutionInfo {
@@ -401,13 +684,28 @@ public:
         double upper_bound_p;
         double upper_bound_n;
         double r;	// for Solver_NU
+        double *G;	// if not NULL, receives the final gradient (length l)
     };
 
     void Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
                double *alpha_, double Cp, double Cn, double eps,
                SolutionInfo* si, int shrinking);
+
+    // undo the index swaps of shrinking on return so that Q can be reused
+    bool keep_order;
+    // if not NULL, the working arrays are taken from it
+    svm_workspace *workspace;
+    // compute the predicted next column of Q on a helper thread (large problems only)
+    bool prefetch;
+    // if not NULL, the state is saved to this file every checkpoint_interval iterations,
+    // a solve of the same problem resumes from it, and it is removed when the solve ends
+    // if this solve wrote or resumed from it
+    const char *checkpoint_file;
+    int checkpoint_interval;
+    uint64_t checkpoint_hash;	// of the training vectors and kernel, see problem_hash
 protected:
     int active_size;
+    int next_i;		// likely i of the next working set (-1: no guess), see select_working_set
     schar *y;
     double *G;		// gradient of objective function
     enum { LOWER_BOUND, UPPER_BOUND, FREE };
@@ -445,6 +743,10 @@ protected:
     virtual void do_shrinking();
 private:
     bool be_shrunk(int i, double Gmax1, double Gmax2);
+    double fingerprint;	// of p and y, with checkpoint_hash identifies the problem a checkpoint belongs to
+    bool checkpoint_owned;	// checkpoint_file was written or resumed from by this solve
+    void save_checkpoint(int iter, int counter);
+    bool load_checkpoint(int &iter, int &counter);
 };
 
 void Solver::swap_index(int i, int j)
@@ -459,6 +761,118 @@ void Solver::swap_index(int i, int j)
     swap(G_bar[i],G_bar[j]);
 }
 
+//
+// checkpoint file: a header, then active_set, alpha, G, G_bar and alpha_status,
+// all in the current (shrinking) order of the solver
+//
+static const char checkpoint_magic[8] = {'S','V','M','C','K','P','T','2'};
+
+void Solver::save_checkpoint(int iter, int counter)
+{
+    // write a temporary file and rename it, so that a killed job never leaves half a checkpoint
+    int len = (int)strlen(checkpoint_file);
+    char *tmp_file = Malloc(char,len+5);
+    memcpy(tmp_file,checkpoint_file,len);
+    memcpy(tmp_file+len,".tmp",5);
+
+    FILE *fp = fopen(tmp_file,"wb");
+    if(fp == NULL)
+    {
+        free(tmp_file);
+        return;
+    }
+    int header[5] = {l, iter, counter, active_size, unshrink};
+    double values[4] = {Cp, Cn, eps, fingerprint};
+    fwrite(checkpoint_magic,1,sizeof(checkpoint_magic),fp);
+    fwrite(header,sizeof(int),5,fp);
+    fwrite(values,sizeof(double),4,fp);
+    fwrite(&checkpoint_hash,sizeof(uint64_t),1,fp);
+    fwrite(active_set,sizeof(int),l,fp);
+    fwrite(alpha,sizeof(double),l,fp);
+    fwrite(G,sizeof(double),l,fp);
+    fwrite(G_bar,sizeof(double),l,fp);
+    fwrite(alpha_status,sizeof(char),l,fp);
+    if(ferror(fp) != 0 || fclose(fp) != 0 || rename(tmp_file,checkpoint_file) != 0)
+        remove(tmp_file);
+    else
+        checkpoint_owned = true;
+    free(tmp_file);
+}
+
+// on success Q, y and p are permuted into the saved order and the state is restored
+bool Solver::load_checkpoint(int &iter, int &counter)
+{
+    if(checkpoint_file == NULL)
+        return false;
+    FILE *fp = fopen(checkpoint_file,"rb");
+    if(fp == NULL)
+        return false;
+
+    char magic[sizeof(checkpoint_magic)];
+    int header[5];
+    double values[4];
+    uint64_t hash;
+    int *order = Malloc(int,l);
+    double *state = Malloc(double,3*(long int)l);	// alpha, G, G_bar
+    char *status = Malloc(char,l);
+    bool ok = fread(magic,1,sizeof(magic),fp) == sizeof(magic) &&
+              memcmp(magic,checkpoint_magic,sizeof(magic)) == 0 &&
+              fread(header,sizeof(int),5,fp) == 5 &&
+              fread(values,sizeof(double),4,fp) == 4 &&
+              fread(&hash,sizeof(uint64_t),1,fp) == 1 &&
+              header[0] == l && values[0] == Cp && values[1] == Cn &&
+              values[2] == eps && values[3] == fingerprint && hash == checkpoint_hash &&
+              fread(order,sizeof(int),l,fp) == (size_t)l &&
+              fread(state,sizeof(double),3*(size_t)l,fp) == 3*(size_t)l &&
+              fread(status,sizeof(char),l,fp) == (size_t)l;
+    fclose(fp);
+
+    // where[k]: current position of index k
+    int *where = Malloc(int,l);
+    int i;
+    for(i=0;i<l;i++)
+        where[i] = -1;
+    for(i=0;i<l && ok;i++)
+    {
+        ok = order[i] >= 0 && order[i] < l && where[order[i]] == -1;
+        if(ok)
+            where[order[i]] = 0;
+    }
+
+    if(ok)
+    {
+        for(i=0;i<l;i++)
+            where[active_set[i]] = i;
+        for(i=0;i<l;i++)
+        {
+            int j = where[order[i]];
+            if(j != i)
+            {
+                swap_index(i,j);
+                where[active_set[i]] = i;
+                where[active_set[j]] = j;
+            }
+        }
+        memcpy(alpha,state,sizeof(double)*l);
+        memcpy(G,state+l,sizeof(double)*l);
+        memcpy(G_bar,state+2*(long int)l,sizeof(double)*l);
+        memcpy(alpha_status,status,l);
+        iter = header[1];
+        counter = header[2];
+        active_size = header[3];
+        unshrink = header[4] != 0;
+        checkpoint_owned = true;
+        info("resuming from iteration %d\n",iter);
+    }
+    else
+        fprintf(stderr,"WARNING: ignoring checkpoint %s of another problem\n",checkpoint_file);
+    free(where);
+    free(order);
+    free(state);
+    free(status);
+    return ok;
+}
+
 void Solver::reconstruct_gradient()
 {
     // reconstruct inactive elements of G from G_bar and free variables
@@ -508,58 +922,70 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
     this->l = l;
     this->Q = &Q;
     QD=Q.get_QD();
-    clone(p, p_,l);
-    clone(y, y_,l);
-    clone(alpha,alpha_,l);
+    svm_workspace *ws = workspace;
+    ws_clone(ws,svm_workspace::P,p,p_,l);
+    ws_clone(ws,svm_workspace::Y,y,y_,l);
+    ws_clone(ws,svm_workspace::ALPHA,alpha,alpha_,l);
     this->Cp = Cp;
     this->Cn = Cn;
     this->eps = eps;
     unshrink = false;
+    checkpoint_owned = false;
+    fingerprint = 0;
+    for(int i=0;i<l;i++)
+        fingerprint += (p_[i]+y_[i])*(i+1);
 
     // initialize alpha_status
     {
-        alpha_status = new char[l];
+        alpha_status = ws_alloc<char>(ws,svm_workspace::ALPHA_STATUS,l);
         for(int i=0;i<l;i++)
             update_alpha_status(i);
     }
 
     // initialize active set (for shrinking)
     {
-        active_set = new int[l];
+        active_set = ws_alloc<int>(ws,svm_workspace::ACTIVE_SET,l);
         for(int i=0;i<l;i++)
             active_set[i] = i;
         active_size = l;
     }
 
-    // initialize gradient
+    // initialize gradient, unless the whole state is restored from a checkpoint
+    int iter = 0;
+    int counter = min(l,1000)+1;
     {
-        G = new double[l];
-        G_bar = new double[l];
+        G = ws_alloc<double>(ws,svm_workspace::G,l);
+        G_bar = ws_alloc<double>(ws,svm_workspace::G_BAR,l);
         int i;
         for(i=0;i<l;i++)
         {
             G[i] = p[i];
             G_bar[i] = 0;
         }
-        for(i=0;i<l;i++)
-            if(!is_lower_bound(i))
-            {
-                const Qfloat *Q_i = Q.get_Q(i,l);
-                double alpha_i = alpha[i];
-                int j;
-                for(j=0;j<l;j++)
-                    G[j] += alpha_i*Q_i[j];
-                if(is_upper_bound(i))
+        if(!load_checkpoint(iter,counter))
+        {
+            for(i=0;i<l;i++)
+                if(!is_lower_bound(i))
+                {
+                    const Qfloat *Q_i = Q.get_Q(i,l);
+                    double alpha_i = alpha[i];
+                    int j;
                     for(j=0;j<l;j++)
-                        G_bar[j] += get_C(i) * Q_i[j];
-            }
+                        G[j] += alpha_i*Q_i[j];
+                    if(is_upper_bound(i))
+                        for(j=0;j<l;j++)
+                            G_bar[j] += get_C(i) * Q_i[j];
+                }
+        }
     }
 
     // optimization step
 
-    int iter = 0;
     int max_iter = max(10000000, l>INT_MAX/100 ? INT_MAX : 100*l);
-    int counter = min(l,1000)+1;
+    next_i = -1;
+    Prefetcher *prefetcher = NULL;
+    if(prefetch && l >= 1000)
+        prefetcher = new Prefetcher(Q,l);
 
     while(iter < max_iter)
     {
@@ -593,6 +1019,11 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
         const Qfloat *Q_i = Q.get_Q(i,active_size);
         const Qfloat *Q_j = Q.get_Q(j,active_size);
 
+        // the helper thread only reads the kernel data, which nothing below changes
+        if(prefetcher && next_i != -1 && next_i != i && next_i != j &&
+           !Q.is_cached(next_i,active_size))
+            prefetcher->start(next_i,active_size);
+
         double C_i = get_C(i);
         double C_j = get_C(j);
 
@@ -726,7 +1157,16 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
                         G_bar[k] += C_j * Q_j[k];
             }
         }
+
+        if(prefetcher)
+            prefetcher->finish();
+
+        if(checkpoint_file != NULL && checkpoint_interval > 0 && iter % checkpoint_interval == 0)
+            save_checkpoint(iter,counter);
     }
+    delete prefetcher;
+    if(checkpoint_owned)
+        remove(checkpoint_file);
 
     if(iter >= max_iter)
     {
@@ -758,28 +1198,31 @@ void Solver::Solve(int l, const QMatrix& Q, const double *p_, const schar *y_,
     {
         for(int i=0;i<l;i++)
             alpha_[active_set[i]] = alpha[i];
+        if(si->G != NULL)
+            for(int i=0;i<l;i++)
+                si->G[active_set[i]] = G[i];
     }
 
     // juggle everything back
-    /*{
+    if(keep_order)
+    {
         for(int i=0;i<l;i++)
             while(active_set[i] != i)
                 swap_index(i,active_set[i]);
-                // or Q.swap_index(i,active_set[i]);
-    }*/
+    }
 
     si->upper_bound_p = Cp;
     si->upper_bound_n = Cn;
 
     info("\noptimization finished, #iter = %d\n",iter);
 
-    delete[] p;
-    delete[] y;
-    delete[] alpha;
-    delete[] alpha_status;
-    delete[] active_set;
-    delete[] G;
-    delete[] G_bar;
+    ws_release(ws,p);
+    ws_release(ws,y);
+    ws_release(ws,alpha);
+    ws_release(ws,alpha_status);
+    ws_release(ws,active_set);
+    ws_release(ws,G);
+    ws_release(ws,G_bar);
 }
 
 // return 1 if already optimal, return 0 otherwise
@@ -796,25 +1239,45 @@ int Solver::select_working_set(int &out_i, int &out_j)
     int Gmax_idx = -1;
     int Gmin_idx = -1;
     double obj_diff_min = INF;
+    double Gnext = -INF;	// runner-up of Gmax, the guess for the next i
 
+    next_i = -1;
     for(int t=0;t<active_size;t++)
         if(y[t]==+1)
         {
             if(!is_upper_bound(t))
+            {
                 if(-G[t] >= Gmax)
                 {
+                    Gnext = Gmax;
+                    next_i = Gmax_idx;
                     Gmax = -G[t];
                     Gmax_idx = t;
                 }
+                else if(-G[t] >= Gnext)
+                {
+                    Gnext = -G[t];
+                    next_i = t;
+                }
+            }
         }
         else
         {
             if(!is_lower_bound(t))
+            {
                 if(G[t] >= Gmax)
                 {
+                    Gnext = Gmax;
+                    next_i = Gmax_idx;
                     Gmax = G[t];
                     Gmax_idx = t;
                 }
+                else if(G[t] >= Gnext)
+                {
+                    Gnext = G[t];
+                    next_i = t;
+                }
+            }
         }
 
     int i = Gmax_idx;
@@ -1266,8 +1729,9 @@ double Solver_NU::calculate_rho()
 class SVC_Q: public Kernel
 {
 public:
-    SVC_Q(const svm_problem& prob, const svm_parameter& param, const schar *y_)
-            :Kernel(prob.l, prob.x, param)
+    template <class P>
+    SVC_Q(const P& prob, const svm_parameter& param, const schar *y_)
+            :Kernel(prob, param)
     {
         clone(y,y_,prob.l);
         cache = new Cache(prob.l,(long int)(param.cache_size*(1<<20)));
@@ -1288,6 +1752,25 @@ public:
         return data;
     }
 
+    bool is_cached(int i, int len) const
+    {
+        return cache->has_data(i,len);
+    }
+
+    void compute_Q(int i, int len, Qfloat *data) const
+    {
+        for(int j=0;j<len;j++)
+            data[j] = (Qfloat)(y[i]*y[j]*(this->*kernel_function)(i,j));
+    }
+
+    void put_Q(int i, int len, const Qfloat *data) const
+    {
+        Qfloat *cached;
+        int start = cache->get_data(i,&cached,len);
+        if(start < len)
+            memcpy(cached+start,data+start,sizeof(Qfloat)*(len-start));
+    }
+
     double *get_QD() const
     {
         return QD;
@@ -1316,11 +1799,11 @@ private:
 class ONE_CLASS_Q: public Kernel
 {
 public:
-    ONE_CLASS_Q(const svm_problem& prob, const svm_parameter& param)
-            :Kernel(prob.l, prob.x, param)
+    template <class P>
+    ONE_CLASS_Q(const P& prob, const svm_parameter& param, svm_workspace *ws = NULL)
+            :Kernel(prob, param, ws), cache(prob.l,(long int)(param.cache_size*(1<<20)),ws)
     {
-        cache = new Cache(prob.l,(long int)(param.cache_size*(1<<20)));
-        QD = new double[prob.l];
+        QD = ws_alloc<double>(ws,svm_workspace::QD,prob.l);
         for(int i=0;i<prob.l;i++)
             QD[i] = (this->*kernel_function)(i,i);
     }
@@ -1329,7 +1812,7 @@ public:
     {
         Qfloat *data;
         int start, j;
-        if((start = cache->get_data(i,&data,len)) < len)
+        if((start = cache.get_data(i,&data,len)) < len)
         {
             for(j=start;j<len;j++)
                 data[j] = (Qfloat)(this->*kernel_function)(i,j);
@@ -1337,6 +1820,25 @@ public:
         return data;
     }
 
+    bool is_cached(int i, int len) const
+    {
+        return cache.has_data(i,len);
+    }
+
+    void compute_Q(int i, int len, Qfloat *data) const
+    {
+        for(int j=0;j<len;j++)
+            data[j] = (Qfloat)(this->*kernel_function)(i,j);
+    }
+
+    void put_Q(int i, int len, const Qfloat *data) const
+    {
+        Qfloat *cached;
+        int start = cache.get_data(i,&cached,len);
+        if(start < len)
+            memcpy(cached+start,data+start,sizeof(Qfloat)*(len-start));
+    }
+
     double *get_QD() const
     {
         return QD;
@@ -1344,26 +1846,26 @@ public:
 
     void swap_index(int i, int j) const
     {
-        cache->swap_index(i,j);
+        cache.swap_index(i,j);
         Kernel::swap_index(i,j);
         swap(QD[i],QD[j]);
     }
 
     ~ONE_CLASS_Q()
     {
-        delete cache;
-        delete[] QD;
+        ws_release(workspace,QD);
     }
 private:
-    Cache *cache;
+    mutable Cache cache;	// a member, so that a solve on a workspace allocates nothing
     double *QD;
 };
 
 class SVR_Q: public Kernel
 {
 public:
-    SVR_Q(const svm_problem& prob, const svm_parameter& param)
-            :Kernel(prob.l, prob.x, param)
+    template <class P>
+    SVR_Q(const P& prob, const svm_parameter& param)
+            :Kernel(prob, param)
     {
         l = prob.l;
         cache = new Cache(l,(long int)(param.cache_size*(1<<20)));
@@ -1435,71 +1937,337 @@ private:
 };
 
 //
-// construct and solve various formulations
+// Kernel values shared by all one-vs-one problems of a multiclass training
 //
-static void solve_c_svc(
-        const svm_problem *prob, const svm_parameter* param,
-        double *alpha, Solver::SolutionInfo* si, double Cp, double Cn)
+// x is grouped by class; the segment of row i and class c holds
+// K(x_i, x_{start[c]}), ..., K(x_i, x_{start[c]+count[c]-1}).
+// A segment is computed once by whichever pair needs it first, published
+// atomically and kept until the end of the training, so concurrent pairs read
+// it without locking. When size (in bytes) is used up, segments are no longer
+// stored and get_segment returns NULL.
+//
+class Shared_Kernel: public Kernel
 {
-    int l = prob->l;
-    double *minus_ones = new double[l];
-    schar *y = new schar[l];
-
-    int i;
-
-    for(i=0;i<l;i++)
+public:
+    Shared_Kernel(int l, svm_node * const * x, const svm_parameter& param,
+                  int nr_class, const int *start, const int *count, long int size)
+            :Kernel(l, x, param), nr_class(nr_class), size(size/(long int)sizeof(Qfloat))
     {
-        alpha[i] = 0;
-        minus_ones[i] = -1;
-        if(prob->y[i] > 0) y[i] = +1; else y[i] = -1;
+        clone(this->start,start,nr_class);
+        clone(this->count,count,nr_class);
+        segment = new std::atomic<Qfloat *>[(long int)l*nr_class];
+        for(long int k=0;k<(long int)l*nr_class;k++)
+            segment[k].store(NULL);
     }
 
-    Solver s;
-    s.Solve(l, SVC_Q(*prob,*param,y), minus_ones, y,
-            alpha, Cp, Cn, param->eps, si, param->shrinking);
-
-    double sum_alpha=0;
-    for(i=0;i<l;i++)
-        sum_alpha += alpha[i];
+    double kernel(int i, int j) const
+    {
+        return (this->*kernel_function)(i,j);
+    }
 
-    if (Cp==Cn)
-        info("nu = %f\n", sum_alpha/(Cp*prob->l));
+    const Qfloat *get_segment(int i, int c) const
+    {
+        std::atomic<Qfloat *>& entry = segment[(long int)i*nr_class+c];
+        Qfloat *data = entry.load(std::memory_order_acquire);
+        if(data != NULL)
+            return data;
 
-    for(i=0;i<l;i++)
-        alpha[i] *= y[i];
+        int len = count[c];
+        if(size.fetch_sub(len) < len)
+        {
+            size.fetch_add(len);
+            return NULL;
+        }
+        data = new Qfloat[len];
+        for(int j=0;j<len;j++)
+            data[j] = (Qfloat)kernel(i,start[c]+j);
 
-    delete[] minus_ones;
-    delete[] y;
-}
+        Qfloat *expected = NULL;
+        if(!entry.compare_exchange_strong(expected,data,std::memory_order_acq_rel))
+        {
+            // another pair got there first
+            delete[] data;
+            size.fetch_add(len);
+            return expected;
+        }
+        return data;
+    }
 
-static void solve_nu_svc(
-        const svm_problem *prob, const svm_parameter *param,
-        double *alpha, Solver::SolutionInfo* si)
-{
-    int i;
-    int l = prob->l;
-    double nu = param->nu;
+    const int *get_start() const { return start; }
+    const int *get_count() const { return count; }
 
-    schar *y = new schar[l];
+    // the rows never move: pairs keep their own permutation
+    Qfloat *get_Q(int, int) const { return NULL; }
+    double *get_QD() const { return NULL; }
+    void swap_index(int, int) const {}
 
-    for(i=0;i<l;i++)
-        if(prob->y[i]>0)
-            y[i] = +1;
-        else
-            y[i] = -1;
+    ~Shared_Kernel()
+    {
+        for(long int k=0;k<(long int)get_l()*nr_class;k++)
+            delete[] segment[k].load();
+        delete[] segment;
+        delete[] start;
+        delete[] count;
+    }
+private:
+    int get_l() const { return start[nr_class-1]+count[nr_class-1]; }
 
-    double sum_pos = nu*l/2;
-    double sum_neg = nu*l/2;
+    int nr_class;
+    int *start;
+    int *count;
+    std::atomic<Qfloat *> *segment;
+    mutable std::atomic<long int> size;
+};
 
-    for(i=0;i<l;i++)
-        if(y[i] == +1)
+// SVC_Q of the one-vs-one problem (class_i, class_j): instances 0..count[class_i]-1
+// are class_i, the rest class_j; kernel columns are filled from the shared segments
+class Shared_SVC_Q: public QMatrix
+{
+public:
+    Shared_SVC_Q(const Shared_Kernel& kernel, int class_i, int class_j,
+                 const svm_parameter& param, const schar *y_)
+            :kernel(kernel), class_i(class_i), class_j(class_j)
+    {
+        ci = kernel.get_count()[class_i];
+        int l = ci + kernel.get_count()[class_j];
+        first[0] = kernel.get_start()[class_i];
+        first[1] = kernel.get_start()[class_j];
+        clone(y,y_,l);
+        cache = new Cache(l,(long int)(param.cache_size*(1<<20)));
+        QD = new double[l];
+        index = new int[l];
+        for(int i=0;i<l;i++)
         {
-            alpha[i] = min(1.0,sum_pos);
-            sum_pos -= alpha[i];
+            index[i] = i;
+            QD[i] = kernel.kernel(row(i),row(i));
         }
-        else
-        {
-            alpha[i] = min(1.0,sum_neg);
+    }
+
+    Qfloat *get_Q(int i, int len) const
+    {
+        Qfloat *data;
+        int start, j;
+        if((start = cache->get_data(i,&data,len)) < len)
+        {
+            int real_i = row(index[i]);
+            const Qfloat *segment[2] = {
+                    kernel.get_segment(real_i,class_i),
+                    kernel.get_segment(real_i,class_j)
+            };
+            for(j=start;j<len;j++)
+            {
+                int side = index[j] < ci ? 0 : 1;
+                int k = index[j] - side*ci;
+                if(segment[side] != NULL)
+                    data[j] = (Qfloat)(y[i]*y[j]*segment[side][k]);
+                else
+                    data[j] = (Qfloat)(y[i]*y[j]*kernel.kernel(real_i,first[side]+k));
+            }
+        }
+        return data;
+    }
+
+    double *get_QD() const
+    {
+        return QD;
+    }
+
+    void swap_index(int i, int j) const
+    {
+        cache->swap_index(i,j);
+        swap(y[i],y[j]);
+        swap(QD[i],QD[j]);
+        swap(index[i],index[j]);
+    }
+
+    ~Shared_SVC_Q()
+    {
+        delete[] y;
+        delete cache;
+        delete[] QD;
+        delete[] index;
+    }
+private:
+    int row(int k) const
+    {
+        return k < ci ? first[0]+k : first[1]+k-ci;
+    }
+
+    const Shared_Kernel& kernel;
+    int class_i, class_j;
+    int ci;
+    int first[2];
+    schar *y;
+    Cache *cache;
+    double *QD;
+    int *index;
+};
+
+// one-vs-one problem (class_i, class_j) whose kernel values come from a Shared_Kernel
+struct shared_pair
+{
+    const Shared_Kernel *kernel;
+    int class_i, class_j;
+};
+
+//
+// construct and solve various formulations
+// (P is svm_problem or svm_dense_problem)
+//
+
+// where and how often a solve saves its state, see Solver::checkpoint_file
+struct solver_checkpoint
+{
+    const char *file;
+    int interval;
+    uint64_t hash;
+};
+
+static void set_checkpoint(Solver& s, const solver_checkpoint *checkpoint)
+{
+    if(checkpoint != NULL)
+    {
+        s.checkpoint_file = checkpoint->file;
+        s.checkpoint_interval = checkpoint->interval;
+        s.checkpoint_hash = checkpoint->hash;
+    }
+}
+
+// FNV-1a
+static uint64_t hash_bytes(uint64_t h, const void *data, size_t n)
+{
+    const unsigned char *c = (const unsigned char *)data;
+    for(size_t k=0;k<n;k++)
+        h = (h ^ c[k]) * 1099511628211ULL;
+    return h;
+}
+
+static uint64_t hash_feature(uint64_t h, int index, double value)
+{
+    h = hash_bytes(h,&index,sizeof(index));
+    return hash_bytes(h,&value,sizeof(value));
+}
+
+// the nonzero features of every instance, so that sparse and dense forms of the same data agree
+static uint64_t hash_vectors(uint64_t h, const svm_problem *prob)
+{
+    for(int i=0;i<prob->l;i++)
+    {
+        for(const svm_node *x=prob->x[i];x->index != -1;x++)
+            if(x->value != 0)
+                h = hash_feature(h,x->index,x->value);
+        h = hash_feature(h,-1,0);
+    }
+    return h;
+}
+
+static uint64_t hash_vectors(uint64_t h, const svm_dense_problem *prob)
+{
+    for(int i=0;i<prob->l;i++)
+    {
+        for(int d=0;d<prob->n;d++)
+            if(prob->column[d][i] != 0)
+                h = hash_feature(h,d+1,prob->column[d][i]);
+        h = hash_feature(h,-1,0);
+    }
+    return h;
+}
+
+// identifies the training vectors and kernel of a checkpoint; Solver itself only sees p, y and C
+template <class P>
+static uint64_t problem_hash(const P *prob, const svm_parameter *param)
+{
+    uint64_t h = hash_vectors(14695981039346656037ULL,prob);
+    h = hash_bytes(h,&param->svm_type,sizeof(int));
+    h = hash_bytes(h,&param->kernel_type,sizeof(int));
+    h = hash_bytes(h,&param->degree,sizeof(int));
+    h = hash_bytes(h,&param->gamma,sizeof(double));
+    h = hash_bytes(h,&param->coef0,sizeof(double));
+    h = hash_bytes(h,&param->nu,sizeof(double));
+    return hash_bytes(h,&param->p,sizeof(double));
+}
+
+// prefetch kernel columns on a helper thread only if asked to and the solve may take a second thread
+static bool use_prefetch(const svm_parameter *param)
+{
+    return param->prefetch && svm_thread_num(param->nr_thread) > 1;
+}
+
+template <class P>
+static void solve_c_svc(
+        const P *prob, const svm_parameter* param,
+        double *alpha, Solver::SolutionInfo* si, double Cp, double Cn,
+        const shared_pair *pair = NULL)
+{
+    int l = prob->l;
+    double *minus_ones = new double[l];
+    schar *y = new schar[l];
+
+    int i;
+
+    for(i=0;i<l;i++)
+    {
+        alpha[i] = 0;
+        minus_ones[i] = -1;
+        if(prob->y[i] > 0) y[i] = +1; else y[i] = -1;
+    }
+
+    Solver s;
+    s.prefetch = use_prefetch(param);
+    if(pair != NULL)
+        s.Solve(l, Shared_SVC_Q(*pair->kernel,pair->class_i,pair->class_j,*param,y), minus_ones, y,
+                alpha, Cp, Cn, param->eps, si, param->shrinking);
+    else
+        s.Solve(l, SVC_Q(*prob,*param,y), minus_ones, y,
+                alpha, Cp, Cn, param->eps, si, param->shrinking);
+
+    double sum_alpha=0;
+    for(i=0;i<l;i++)
+        sum_alpha += alpha[i];
+
+    if (Cp==Cn)
+        info("nu = %f\n", sum_alpha/(Cp*prob->l));
+
+    for(i=0;i<l;i++)
+        alpha[i] *= y[i];
+    if(si->G != NULL)
+        for(i=0;i<l;i++)
+            si->G[i] += 1;
+
+    delete[] minus_ones;
+    delete[] y;
+}
+
+template <class P>
+static void solve_nu_svc(
+        const P *prob, const svm_parameter *param,
+        double *alpha, Solver::SolutionInfo* si,
+        const shared_pair *pair = NULL)
+{
+    int i;
+    int l = prob->l;
+    double nu = param->nu;
+
+    schar *y = new schar[l];
+
+    for(i=0;i<l;i++)
+        if(prob->y[i]>0)
+            y[i] = +1;
+        else
+            y[i] = -1;
+
+    double sum_pos = nu*l/2;
+    double sum_neg = nu*l/2;
+
+    for(i=0;i<l;i++)
+        if(y[i] == +1)
+        {
+            alpha[i] = min(1.0,sum_pos);
+            sum_pos -= alpha[i];
+        }
+        else
+        {
+            alpha[i] = min(1.0,sum_neg);
             sum_neg -= alpha[i];
         }
 
@@ -1509,14 +2277,21 @@ static void solve_nu_svc(
         zeros[i] = 0;
 
     Solver_NU s;
-    s.Solve(l, SVC_Q(*prob,*param,y), zeros, y,
-            alpha, 1.0, 1.0, param->eps, si,  param->shrinking);
+    if(pair != NULL)
+        s.Solve(l, Shared_SVC_Q(*pair->kernel,pair->class_i,pair->class_j,*param,y), zeros, y,
+                alpha, 1.0, 1.0, param->eps, si,  param->shrinking);
+    else
+        s.Solve(l, SVC_Q(*prob,*param,y), zeros, y,
+                alpha, 1.0, 1.0, param->eps, si,  param->shrinking);
     double r = si->r;
 
     info("C = %f\n",1/r);
 
     for(i=0;i<l;i++)
         alpha[i] *= y[i]/r;
+    if(si->G != NULL)
+        for(i=0;i<l;i++)
+            si->G[i] /= r;
 
     si->rho /= r;
     si->obj /= (r*r);
@@ -1527,23 +2302,69 @@ static void solve_nu_svc(
     delete[] zeros;
 }
 
-static void solve_one_class(
-        const svm_problem *prob, const svm_parameter *param,
-        double *alpha, Solver::SolutionInfo* si)
+// initial feasible point: the first nu*l alphas at the upper bound
+static void one_class_init_alpha(int l, double nu, double *alpha)
 {
-    int l = prob->l;
-    double *zeros = new double[l];
-    schar *ones = new schar[l];
     int i;
-
-    int n = (int)(param->nu*prob->l);	// # of alpha's at upper bound
+    int n = (int)(nu*l);	// # of alpha's at upper bound
 
     for(i=0;i<n;i++)
         alpha[i] = 1;
-    if(n<prob->l)
-        alpha[n] = param->nu * prob->l - n;
+    if(n<l)
+        alpha[n] = nu * l - n;
     for(i=n+1;i<l;i++)
         alpha[i] = 0;
+}
+
+// move a solution for old_nu to a feasible point for new_nu:
+// scale, clip to the upper bound and spread what is left over
+// e^T alpha = new_nu*l, support vectors first
+static void one_class_warm_alpha(int l, double old_nu, double new_nu, double *alpha)
+{
+    int i;
+    double ratio = new_nu/old_nu;
+    double rest = new_nu*l;
+
+    for(i=0;i<l;i++)
+    {
+        alpha[i] = min(alpha[i]*ratio,1.0);
+        rest -= alpha[i];
+    }
+    for(int pass=0;pass<2 && rest>0;pass++)
+        for(i=0;i<l && rest>0;i++)
+            if(alpha[i] < 1 && (pass == 1 || alpha[i] > 0))
+            {
+                double add = min(1-alpha[i],rest);
+                alpha[i] += add;
+                rest -= add;
+            }
+    for(i=0;i<l && rest<0;i++)
+    {
+        double sub = min(alpha[i],-rest);
+        alpha[i] -= sub;
+        rest += sub;
+    }
+}
+
+// Q != NULL: solve with a kernel matrix (and cache) owned by the caller
+// warm_nu > 0: alpha holds the solution for nu = warm_nu and is used as the starting point
+// ws != NULL: all working arrays, the kernel matrix included, are taken from ws
+template <class P>
+static void solve_one_class(
+        const P *prob, const svm_parameter *param,
+        double *alpha, Solver::SolutionInfo* si,
+        const QMatrix *Q = NULL, double warm_nu = 0, svm_workspace *ws = NULL,
+        const solver_checkpoint *checkpoint = NULL)
+{
+    int l = prob->l;
+    double *zeros = ws_alloc<double>(ws,svm_workspace::ZEROS,l);
+    schar *ones = ws_alloc<schar>(ws,svm_workspace::ONES,l);
+    int i;
+
+    if(warm_nu > 0)
+        one_class_warm_alpha(l,warm_nu,param->nu,alpha);
+    else
+        one_class_init_alpha(l,param->nu,alpha);
 
     for(i=0;i<l;i++)
     {
@@ -1552,16 +2373,28 @@ static void solve_one_class(
     }
 
     Solver s;
-    s.Solve(l, ONE_CLASS_Q(*prob,*param), zeros, ones,
-            alpha, 1.0, 1.0, param->eps, si, param->shrinking);
+    s.workspace = ws;
+    s.prefetch = use_prefetch(param);
+    set_checkpoint(s,checkpoint);
+    if(Q != NULL)
+    {
+        s.keep_order = true;
+        s.Solve(l, *Q, zeros, ones,
+                alpha, 1.0, 1.0, param->eps, si, param->shrinking);
+    }
+    else
+        s.Solve(l, ONE_CLASS_Q(*prob,*param,ws), zeros, ones,
+                alpha, 1.0, 1.0, param->eps, si, param->shrinking);
 
-    delete[] zeros;
-    delete[] ones;
+    ws_release(ws,zeros);
+    ws_release(ws,ones);
 }
 
+template <class P>
 static void solve_epsilon_svr(
-        const svm_problem *prob, const svm_parameter *param,
-        double *alpha, Solver::SolutionInfo* si)
+        const P *prob, const svm_parameter *param,
+        double *alpha, Solver::SolutionInfo* si,
+        const solver_checkpoint *checkpoint = NULL)
 {
     int l = prob->l;
     double *alpha2 = new double[2*l];
@@ -1581,6 +2414,7 @@ static void solve_epsilon_svr(
     }
 
     Solver s;
+    set_checkpoint(s,checkpoint);
     s.Solve(2*l, SVR_Q(*prob,*param), linear_term, y,
             alpha2, param->C, param->C, param->eps, si, param->shrinking);
 
@@ -1597,9 +2431,11 @@ static void solve_epsilon_svr(
     delete[] y;
 }
 
+template <class P>
 static void solve_nu_svr(
-        const svm_problem *prob, const svm_parameter *param,
-        double *alpha, Solver::SolutionInfo* si)
+        const P *prob, const svm_parameter *param,
+        double *alpha, Solver::SolutionInfo* si,
+        const solver_checkpoint *checkpoint = NULL)
 {
     int l = prob->l;
     double C = param->C;
@@ -1622,6 +2458,7 @@ static void solve_nu_svr(
     }
 
     Solver_NU s;
+    set_checkpoint(s,checkpoint);
     s.Solve(2*l, SVR_Q(*prob,*param), linear_term, y,
             alpha2, C, C, param->eps, si, param->shrinking);
 
@@ -1644,33 +2481,56 @@ struct decision_function
     double rho;
 };
 
+// dec_values: if not NULL, receives the decision value of every training
+// instance, read off the final gradient (C_SVC, NU_SVC and ONE_CLASS only)
+// pair: if not NULL, the kernel values of this classification problem are taken from a shared cache
+// ws: if not NULL (ONE_CLASS only), the solve runs on this workspace and f.alpha belongs to it
+// checkpoint: if not NULL (ONE_CLASS, EPSILON_SVR and NU_SVR only), the solve saves and resumes its state
+template <class P>
 static decision_function svm_train_one(
-        const svm_problem *prob, const svm_parameter *param,
-        double Cp, double Cn)
+        const P *prob, const svm_parameter *param,
+        double Cp, double Cn, double *dec_values = NULL,
+        const shared_pair *pair = NULL, svm_workspace *ws = NULL,
+        const solver_checkpoint *checkpoint = NULL)
 {
-    double *alpha = Malloc(double,prob->l);
+    double *alpha = ws ? ws_alloc<double>(ws,svm_workspace::TRAIN_ALPHA,prob->l) : Malloc(double,prob->l);
     Solver::SolutionInfo si;
+    // the solvers leave y_i * (f(x_i) + rho) in G
+    if(param->svm_type == EPSILON_SVR || param->svm_type == NU_SVR)
+        dec_values = NULL;
+    si.G = dec_values;
     switch(param->svm_type)
     {
         case C_SVC:
-            solve_c_svc(prob,param,alpha,&si,Cp,Cn);
+            solve_c_svc(prob,param,alpha,&si,Cp,Cn,pair);
             break;
         case NU_SVC:
-            solve_nu_svc(prob,param,alpha,&si);
+            solve_nu_svc(prob,param,alpha,&si,pair);
             break;
         case ONE_CLASS:
-            solve_one_class(prob,param,alpha,&si);
+            solve_one_class(prob,param,alpha,&si,(const QMatrix *)NULL,0,ws,checkpoint);
             break;
         case EPSILON_SVR:
-            solve_epsilon_svr(prob,param,alpha,&si);
+            solve_epsilon_svr(prob,param,alpha,&si,checkpoint);
             break;
         case NU_SVR:
-            solve_nu_svr(prob,param,alpha,&si);
+            solve_nu_svr(prob,param,alpha,&si,checkpoint);
             break;
     }
 
     info("obj = %f, rho = %f\n",si.obj,si.rho);
 
+    if(dec_values != NULL)
+    {
+        for(int i=0;i<prob->l;i++)
+        {
+            if(param->svm_type == ONE_CLASS || prob->y[i] > 0)
+                dec_values[i] -= si.rho;
+            else
+                dec_values[i] = -dec_values[i] - si.rho;
+        }
+    }
+
     // output SVs
 
     int nSV = 0;
@@ -1815,39 +2675,42 @@ static void sigmoid_train(
     free(t);
 }
 
-static double sigmoid_predict(double decision_value, double A, double B)
+// min(max(sigmoid_predict(dec_values[i],A[i],B[i]),min_prob),1-min_prob) for i < n; one exp per
+// value and no branches, so the loop over all pairs (and rows) vectorizes apart from exp itself
+static void sigmoid_predict(int n, const double *dec_values, const double *A, const double *B, double min_prob,
+                            double *p)
 {
-    double fApB = decision_value*A+B;
-    // 1-p used later; avoid catastrophic cancellation
-    if (fApB >= 0)
-        return exp(-fApB)/(1.0+exp(-fApB));
-    else
-        return 1.0/(1+exp(fApB)) ;
+    for (int i=0;i<n;i++)
+    {
+        double fApB = dec_values[i]*A[i]+B[i];
+        // 1-p used later; avoid catastrophic cancellation
+        double e = exp(-fabs(fApB));
+        double q = fApB >= 0 ? e/(1.0+e) : 1.0/(1+e);
+        p[i] = min(max(q,min_prob),1-min_prob);
+    }
 }
 
 // Method 2 from the multiclass_prob paper by Wu, Lin, and Weng
-static void multiclass_probability(int k, double **r, double *p)
+// r[i*k+j] is the pairwise probability of class i over class j; Q (k*k) and Qp (k) are scratch
+static void multiclass_probability(int k, const double *r, double *p, double *Q, double *Qp)
 {
     int t,j;
     int iter = 0, max_iter=max(100,k);
-    double **Q=Malloc(double *,k);
-    double *Qp=Malloc(double,k);
     double pQp, eps=0.005/k;
 
     for (t=0;t<k;t++)
     {
         p[t]=1.0/k;  // Valid if k = 1
-        Q[t]=Malloc(double,k);
-        Q[t][t]=0;
+        Q[t*k+t]=0;
         for (j=0;j<t;j++)
         {
-            Q[t][t]+=r[j][t]*r[j][t];
-            Q[t][j]=Q[j][t];
+            Q[t*k+t]+=r[j*k+t]*r[j*k+t];
+            Q[t*k+j]=Q[j*k+t];
         }
         for (j=t+1;j<k;j++)
         {
-            Q[t][t]+=r[j][t]*r[j][t];
-            Q[t][j]=-r[j][t]*r[t][j];
+            Q[t*k+t]+=r[j*k+t]*r[j*k+t];
+            Q[t*k+j]=-r[j*k+t]*r[t*k+j];
         }
     }
     for (iter=0;iter<max_iter;iter++)
@@ -1858,7 +2721,7 @@ static void multiclass_probability(int k, double **r, double *p)
         {
             Qp[t]=0;
             for (j=0;j<k;j++)
-                Qp[t]+=Q[t][j]*p[j];
+                Qp[t]+=Q[t*k+j]*p[j];
             pQp+=p[t]*Qp[t];
         }
         double max_error=0;
@@ -1872,62 +2735,109 @@ static void multiclass_probability(int k, double **r, double *p)
 
         for (t=0;t<k;t++)
         {
-            double diff=(-Qp[t]+pQp)/Q[t][t];
+            double diff=(-Qp[t]+pQp)/Q[t*k+t];
             p[t]+=diff;
-            pQp=(pQp+diff*(diff*Q[t][t]+2*Qp[t]))/(1+diff)/(1+diff);
+            pQp=(pQp+diff*(diff*Q[t*k+t]+2*Qp[t]))/(1+diff)/(1+diff);
             for (j=0;j<k;j++)
             {
-                Qp[j]=(Qp[j]+diff*Q[t][j])/(1+diff);
+                Qp[j]=(Qp[j]+diff*Q[t*k+j])/(1+diff);
                 p[j]/=(1+diff);
             }
         }
     }
     if (iter>=max_iter)
         info("Exceeds max_iter in multiclass_prob\n");
-    for(t=0;t<k;t++) free(Q[t]);
-    free(Q);
-    free(Qp);
+}
+
+// class probabilities from the clamped pairwise sigmoids pair_prob (one per pair, in the order of
+// dec_values); returns the index of the most probable class
+static int pairwise_coupling(int nr_class, const double *pair_prob, double *prob_estimates, svm_workspace *ws)
+{
+    int i;
+    if (nr_class == 2)
+    {
+        prob_estimates[0] = pair_prob[0];
+        prob_estimates[1] = 1-pair_prob[0];
+    }
+    else
+    {
+        double *r = ws_alloc<double>(ws,svm_workspace::PAIRWISE_PROB,nr_class*nr_class);
+        double *Q = ws_alloc<double>(ws,svm_workspace::PROB_Q,nr_class*nr_class);
+        double *Qp = ws_alloc<double>(ws,svm_workspace::PROB_QP,nr_class);
+        int k=0;
+        for(i=0;i<nr_class;i++)
+            for(int j=i+1;j<nr_class;j++)
+            {
+                r[i*nr_class+j]=pair_prob[k];
+                r[j*nr_class+i]=1-pair_prob[k];
+                k++;
+            }
+        multiclass_probability(nr_class,r,prob_estimates,Q,Qp);
+        ws_release(ws,r);
+        ws_release(ws,Q);
+        ws_release(ws,Qp);
+    }
+
+    int prob_max_idx = 0;
+    for(i=1;i<nr_class;i++)
+        if(prob_estimates[i] > prob_estimates[prob_max_idx])
+            prob_max_idx = i;
+    return prob_max_idx;
 }
 
 // Cross-validation decision values for probability estimates
+// The folds of all nr_pair binary problems, then their sigmoid fits, run in
+// parallel. Each problem is shuffled by its own generator seeded with its pair
+// index, so the result does not depend on rand() or on the thread schedule.
 static void svm_binary_svc_probability(
-        const svm_problem *prob, const svm_parameter *param,
-        double Cp, double Cn, double& probA, double& probB)
+        int nr_pair, const svm_problem *prob, const svm_parameter *param,
+        const double *Cp, const double *Cn, double *probA, double *probB)
 {
-    int i;
+    int i, p;
     int nr_fold = 5;
-    int *perm = Malloc(int,prob->l);
-    double *dec_values = Malloc(double,prob->l);
+    int **perm = Malloc(int *,nr_pair);
+    double **dec_values = Malloc(double *,nr_pair);
 
     // random shuffle
-    for(i=0;i<prob->l;i++) perm[i]=i;
-    for(i=0;i<prob->l;i++)
+    for(p=0;p<nr_pair;p++)
     {
-        int j = i+rand()%(prob->l-i);
-        swap(perm[i],perm[j]);
+        std::mt19937 rng(p);
+        perm[p] = Malloc(int,prob[p].l);
+        dec_values[p] = Malloc(double,prob[p].l);
+        for(i=0;i<prob[p].l;i++) perm[p][i]=i;
+        for(i=0;i<prob[p].l;i++)
+        {
+            int j = i+(int)(rng()%(prob[p].l-i));
+            swap(perm[p][i],perm[p][j]);
+        }
     }
-    for(i=0;i<nr_fold;i++)
-    {
-        int begin = i*prob->l/nr_fold;
-        int end = (i+1)*prob->l/nr_fold;
+
+    int nr_thread = svm_thread_num(param->nr_thread);
+    nr_thread = min(nr_thread,nr_pair*nr_fold);
+    parallel_for(nr_pair*nr_fold,nr_thread,[&](int t) {
+        int p = t/nr_fold;
+        int i = t%nr_fold;
+        const svm_problem *pprob = &prob[p];
+        int begin = i*pprob->l/nr_fold;
+        int end = (i+1)*pprob->l/nr_fold;
         int j,k;
         struct svm_problem subprob;
 
-        subprob.l = prob->l-(end-begin);
+        subprob.l = pprob->l-(end-begin);
         subprob.x = Malloc(struct svm_node*,subprob.l);
         subprob.y = Malloc(double,subprob.l);
 
         k=0;
         for(j=0;j<begin;j++)
         {
-            subprob.x[k] = prob->x[perm[j]];
-            subprob.y[k] = prob->y[perm[j]];
+            subprob.x[k] = pprob->x[perm[p][j]];
+            subprob.y[k] = pprob->y[perm[p][j]];
             ++k;
         }
-        for(j=end;j<prob->l;j++)
+        for(j=end;j<pprob->l;j++)
         {
-            subprob.x[k] = prob->x[perm[j]];
-            subprob.y[k] = prob->y[perm[j]];
+            subprob.x[k] = pprob->x[perm[p][j]];
+            subprob.y[k] = pprob->y[perm[p][j]];
             ++k;
         }
         int p_count=0,n_count=0;
@@ -1939,43 +2849,57 @@ static void svm_binary_svc_probability(
 
         if(p_count==0 && n_count==0)
             for(j=begin;j<end;j++)
-                dec_values[perm[j]] = 0;
+                dec_values[p][perm[p][j]] = 0;
         else if(p_count > 0 && n_count == 0)
             for(j=begin;j<end;j++)
-                dec_values[perm[j]] = 1;
+                dec_values[p][perm[p][j]] = 1;
         else if(p_count == 0 && n_count > 0)
             for(j=begin;j<end;j++)
-                dec_values[perm[j]] = -1;
+                dec_values[p][perm[p][j]] = -1;
         else
         {
             svm_parameter subparam = *param;
             subparam.probability=0;
             subparam.C=1.0;
+            subparam.nr_thread=1;
+            subparam.cache_size=param->cache_size/nr_thread;
             subparam.nr_weight=2;
             subparam.weight_label = Malloc(int,2);
             subparam.weight = Malloc(double,2);
             subparam.weight_label[0]=+1;
             subparam.weight_label[1]=-1;
-            subparam.weight[0]=Cp;
-            subparam.weight[1]=Cn;
+            subparam.weight[0]=Cp[p];
+            subparam.weight[1]=Cn[p];
             struct svm_model *submodel = svm_train(&subprob,&subparam);
             for(j=begin;j<end;j++)
             {
-                svm_predict_values(submodel,prob->x[perm[j]],&(dec_values[perm[j]]));
+                svm_predict_values(submodel,pprob->x[perm[p][j]],&(dec_values[p][perm[p][j]]));
                 // ensure +1 -1 order; reason not using CV subroutine
-                dec_values[perm[j]] *= submodel->label[0];
+                dec_values[p][perm[p][j]] *= submodel->label[0];
             }
             svm_free_and_destroy_model(&submodel);
             svm_destroy_param(&subparam);
         }
         free(subprob.x);
         free(subprob.y);
+    });
+
+    parallel_for(nr_pair,nr_thread,[&](int p) {
+        sigmoid_train(prob[p].l,dec_values[p],prob[p].y,probA[p],probB[p]);
+    });
+
+    for(p=0;p<nr_pair;p++)
+    {
+        free(dec_values[p]);
+        free(perm[p]);
     }
-    sigmoid_train(prob->l,dec_values,prob->y,probA,probB);
     free(dec_values);
     free(perm);
 }
 
+static void cross_validation(const svm_problem *prob, const svm_parameter *param, int nr_fold,
+                             double *target, std::mt19937 *rng);
+
 // Return parameter of a Laplace distribution
 static double svm_svr_probability(
         const svm_problem *prob, const svm_parameter *param)
@@ -1987,7 +2911,8 @@ static double svm_svr_probability(
 
     svm_parameter newparam = *param;
     newparam.probability = 0;
-    svm_cross_validation(prob,&newparam,nr_fold,ymv);
+    std::mt19937 rng(0);
+    cross_validation(prob,&newparam,nr_fold,ymv,&rng);
     for(i=0;i<prob->l;i++)
     {
         ymv[i]=prob->y[i]-ymv[i];
@@ -2086,11 +3011,80 @@ static void svm_group_classes(const svm_problem *prob, int *nr_class_ret, int **
     free(data_label);
 }
 
+// rho, SVs and coefficients of a one-class or regression model
+static void fill_single_model(svm_model *model, const svm_problem *prob, const decision_function& f)
+{
+    model->rho = Malloc(double,1);
+    model->rho[0] = f.rho;
+
+    int nSV = 0;
+    int i;
+    for(i=0;i<prob->l;i++)
+        if(fabs(f.alpha[i]) > 0) ++nSV;
+    model->l = nSV;
+    model->SV = Malloc(svm_node *,nSV);
+    model->sv_coef[0] = Malloc(double,nSV);
+    model->sv_indices = Malloc(int,nSV);
+    int j = 0;
+    for(i=0;i<prob->l;i++)
+        if(fabs(f.alpha[i]) > 0)
+        {
+            model->SV[j] = prob->x[i];
+            model->sv_coef[0][j] = f.alpha[i];
+            model->sv_indices[j] = i+1;
+            ++j;
+        }
+}
+
+// the same for a dense problem: the SVs are copied out of the columns
+// into one block owned by the model
+static void fill_single_model(svm_model *model, const svm_dense_problem *prob, const decision_function& f)
+{
+    model->rho = Malloc(double,1);
+    model->rho[0] = f.rho;
+
+    int nSV = 0;
+    int i, d;
+    int n = prob->n;
+    for(i=0;i<prob->l;i++)
+        if(fabs(f.alpha[i]) > 0) ++nSV;
+    model->l = nSV;
+    model->SV = Malloc(svm_node *,nSV);
+    model->sv_coef[0] = Malloc(double,nSV);
+    model->sv_indices = Malloc(int,nSV);
+    svm_node *x_space = NULL;
+    if(nSV > 0)
+        x_space = Malloc(svm_node,(long int)nSV*(n+1));
+    int j = 0;
+    for(i=0;i<prob->l;i++)
+        if(fabs(f.alpha[i]) > 0)
+        {
+            svm_node *x = &x_space[(long int)j*(n+1)];
+            for(d=0;d<n;d++)
+            {
+                x[d].index = d+1;
+                x[d].value = prob->column[d][i];
+            }
+            x[n].index = -1;
+            model->SV[j] = x;
+            model->sv_coef[0][j] = f.alpha[i];
+            model->sv_indices[j] = i+1;
+            ++j;
+        }
+    model->free_sv = 1;
+}
+
 //
 // Interface functions
 //
-svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
+// dec_values: if not NULL, receives the decision values of the training
+// instances when the model has a single decision function
+// (ONE_CLASS, or C_SVC/NU_SVC with two classes); returns false otherwise
+static svm_model *svm_train_internal(const svm_problem *prob, const svm_parameter *param,
+                                     double *dec_values, bool *has_dec_values, svm_workspace *ws = NULL,
+                                     const solver_checkpoint *checkpoint = NULL)
 {
+    *has_dec_values = false;
     svm_model *model = Malloc(svm_model,1);
     model->param = *param;
     model->free_sv = 0;	// XXX
@@ -2114,29 +3108,16 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
             model->probA[0] = svm_svr_probability(prob,param);
         }
 
-        decision_function f = svm_train_one(prob,param,0,0);
-        model->rho = Malloc(double,1);
-        model->rho[0] = f.rho;
-
-        int nSV = 0;
-        int i;
-        for(i=0;i<prob->l;i++)
-            if(fabs(f.alpha[i]) > 0) ++nSV;
-        model->l = nSV;
-        model->SV = Malloc(svm_node *,nSV);
-        model->sv_coef[0] = Malloc(double,nSV);
-        model->sv_indices = Malloc(int,nSV);
-        int j = 0;
-        for(i=0;i<prob->l;i++)
-            if(fabs(f.alpha[i]) > 0)
-            {
-                model->SV[j] = prob->x[i];
-                model->sv_coef[0][j] = f.alpha[i];
-                model->sv_indices[j] = i+1;
-                ++j;
-            }
-
-        free(f.alpha);
+        if(param->svm_type != ONE_CLASS)
+        {
+            dec_values = NULL;
+            ws = NULL;
+        }
+        decision_function f = svm_train_one(prob,param,0,0,dec_values,NULL,ws,checkpoint);
+        fill_single_model(model,prob,f);
+        *has_dec_values = dec_values != NULL;
+        if(ws == NULL)
+            free(f.alpha);
     }
     else
     {
@@ -2189,48 +3170,104 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
             probB=Malloc(double,nr_class*(nr_class-1)/2);
         }
 
+        // the single binary problem is laid out in perm order
+        double *sub_dec_values = NULL;
+        if(dec_values != NULL && nr_class == 2)
+            sub_dec_values = Malloc(double,l);
+
+        // the binary problems are independent: build them all, then train them
+        // concurrently, each with a share of the kernel cache; with shared_cache
+        // half of the cache holds kernel values common to all pairs
+
+        int nr_pair = nr_class*(nr_class-1)/2;
+        svm_problem *sub_prob = Malloc(svm_problem,nr_pair);
+        int *pair_i = Malloc(int,nr_pair);
+        int *pair_j = Malloc(int,nr_pair);
         int p = 0;
         for(i=0;i<nr_class;i++)
             for(int j=i+1;j<nr_class;j++)
             {
-                svm_problem sub_prob;
                 int si = start[i], sj = start[j];
                 int ci = count[i], cj = count[j];
-                sub_prob.l = ci+cj;
-                sub_prob.x = Malloc(svm_node *,sub_prob.l);
-                sub_prob.y = Malloc(double,sub_prob.l);
+                sub_prob[p].l = ci+cj;
+                sub_prob[p].x = Malloc(svm_node *,sub_prob[p].l);
+                sub_prob[p].y = Malloc(double,sub_prob[p].l);
                 int k;
                 for(k=0;k<ci;k++)
                 {
-                    sub_prob.x[k] = x[si+k];
-                    sub_prob.y[k] = +1;
+                    sub_prob[p].x[k] = x[si+k];
+                    sub_prob[p].y[k] = +1;
                 }
                 for(k=0;k<cj;k++)
                 {
-                    sub_prob.x[ci+k] = x[sj+k];
-                    sub_prob.y[ci+k] = -1;
+                    sub_prob[p].x[ci+k] = x[sj+k];
+                    sub_prob[p].y[ci+k] = -1;
                 }
-
-                if(param->probability)
-                    svm_binary_svc_probability(&sub_prob,param,weighted_C[i],weighted_C[j],probA[p],probB[p]);
-
-                f[p] = svm_train_one(&sub_prob,param,weighted_C[i],weighted_C[j]);
-                for(k=0;k<ci;k++)
-                    if(!nonzero[si+k] && fabs(f[p].alpha[k]) > 0)
-                        nonzero[si+k] = true;
-                for(k=0;k<cj;k++)
-                    if(!nonzero[sj+k] && fabs(f[p].alpha[ci+k]) > 0)
-                        nonzero[sj+k] = true;
-                free(sub_prob.x);
-                free(sub_prob.y);
+                pair_i[p] = i;
+                pair_j[p] = j;
                 ++p;
             }
 
-        // build output
-
-        model->nr_class = nr_class;
-
-        model->label = Malloc(int,nr_class);
+        if(param->probability)
+        {
+            double *Cp = Malloc(double,nr_pair);
+            double *Cn = Malloc(double,nr_pair);
+            for(p=0;p<nr_pair;p++)
+            {
+                Cp[p] = weighted_C[pair_i[p]];
+                Cn[p] = weighted_C[pair_j[p]];
+            }
+            svm_binary_svc_probability(nr_pair,sub_prob,param,Cp,Cn,probA,probB);
+            free(Cp);
+            free(Cn);
+        }
+
+        int nr_thread = svm_thread_num(param->nr_thread);
+        nr_thread = min(nr_thread,nr_pair);
+        svm_parameter subparam = *param;
+        subparam.cache_size = param->cache_size/nr_thread;
+        if(nr_thread > 1)
+            subparam.nr_thread = 1;	// the pairs already use all threads
+        Shared_Kernel *shared_kernel = NULL;
+        if(param->shared_cache && nr_class > 2)
+        {
+            subparam.cache_size /= 2;
+            shared_kernel = new Shared_Kernel(l,x,*param,nr_class,start,count,
+                                              (long int)(param->cache_size/2*(1<<20)));
+        }
+        parallel_for(nr_pair,nr_thread,[&](int p) {
+            shared_pair pair;
+            pair.kernel = shared_kernel;
+            pair.class_i = pair_i[p];
+            pair.class_j = pair_j[p];
+            f[p] = svm_train_one(&sub_prob[p],&subparam,weighted_C[pair_i[p]],weighted_C[pair_j[p]],
+                                 p == 0 ? sub_dec_values : NULL, shared_kernel != NULL ? &pair : NULL);
+        });
+        delete shared_kernel;
+
+        for(p=0;p<nr_pair;p++)
+        {
+            int si = start[pair_i[p]], sj = start[pair_j[p]];
+            int ci = count[pair_i[p]], cj = count[pair_j[p]];
+            int k;
+            for(k=0;k<ci;k++)
+                if(!nonzero[si+k] && fabs(f[p].alpha[k]) > 0)
+                    nonzero[si+k] = true;
+            for(k=0;k<cj;k++)
+                if(!nonzero[sj+k] && fabs(f[p].alpha[ci+k]) > 0)
+                    nonzero[sj+k] = true;
+            free(sub_prob[p].x);
+            free(sub_prob[p].y);
+        }
+        free(sub_prob);
+        free(pair_i);
+        free(pair_j);
+
+        // build output
+
+        model->nr_class = nr_class;
+
+        model->label = Malloc(int,nr_class);
         for(i=0;i<nr_class;i++)
             model->label[i] = label[i];
 
@@ -2317,6 +3354,14 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
                 ++p;
             }
 
+        if(sub_dec_values != NULL)
+        {
+            for(i=0;i<l;i++)
+                dec_values[perm[i]] = sub_dec_values[i];
+            *has_dec_values = true;
+            free(sub_dec_values);
+        }
+
         free(label);
         free(probA);
         free(probB);
@@ -2335,8 +3380,392 @@ svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
     return model;
 }
 
+svm_model *svm_train(const svm_problem *prob, const svm_parameter *param)
+{
+    bool has_dec_values;
+    return svm_train_internal(prob,param,NULL,&has_dec_values);
+}
+
+// leave-one-out error estimate from the alphas and training decision values of a single fit.
+// C_SVC/NU_SVC use the xi-alpha estimate (Joachims, 2000): instance i can only be misclassified
+// when left out if
+//	2 * alpha_i * R^2 + xi_i >= 1,	xi_i = max(0, 1 - y_i f(x_i))
+// where R^2 bounds max K(x,x) - min K(x,x') (1 for RBF).
+// ONE_CLASS uses the span estimate (Vapnik and Chapelle, 2000): the free SVs F are assumed to stay
+// free when i is left out, so their alphas and rho move to satisfy the KKT conditions again. With
+// M = [K_FF 1; 1' 0] and H = M^-1 the left-out decision value is
+//	f(x_i) + (nu*H_{rho,i} - alpha_i) / H_ii			for i in F
+//	f(x_i) + alpha_i*(v'Hv - K_ii) - nu*(Hv)_rho,	v = [K_Fi; 1]	otherwise
+// where the nu terms account for the sum of the alphas dropping from nu*l to nu*(l-1). It is taken
+// against the moved threshold rho', and i is an error when it is not above it.
+static const svm_node *problem_row(const svm_problem *prob, int i, svm_node *)
+{
+    return prob->x[i];
+}
+
+static const svm_node *problem_row(const svm_dense_problem *prob, int i, svm_node *buffer)
+{
+    for(int d=0;d<prob->n;d++)
+    {
+        buffer[d].index = d+1;
+        buffer[d].value = prob->column[d][i];
+    }
+    buffer[prob->n].index = -1;
+    return buffer;
+}
+
+static int problem_dim(const svm_problem *) { return 0; }
+static int problem_dim(const svm_dense_problem *prob) { return prob->n; }
+
+// number of one-class leave-one-out errors by the span estimate above
+template <class P>
+static int one_class_span_errors(const P *prob, const svm_model *model, const double *dec_values,
+                                 const double *alpha)
+{
+    int i, j, k;
+    int l = prob->l;
+    const svm_parameter& param = model->param;
+    svm_node *buffer = Malloc(svm_node,problem_dim(prob)+1);
+
+    // position of each instance among the free SVs, -1 if not free
+    int *free_index = Malloc(int,l);
+    int nr_free = 0;
+    for(i=0;i<l;i++)
+        free_index[i] = (alpha[i] > 0 && alpha[i] < 1) ? nr_free++ : -1;
+    const svm_node **free_sv = Malloc(const svm_node *,nr_free);
+    for(i=0;i<model->l;i++)
+    {
+        int index = model->sv_indices[i]-1;
+        if(free_index[index] >= 0)
+            free_sv[free_index[index]] = model->SV[i];
+    }
+
+    // without free SVs rho is not pinned by any equality, so every SV is counted
+    int nr_error = 0;
+    if(nr_free == 0)
+    {
+        for(i=0;i<l;i++)
+            if(alpha[i] > 0 || dec_values[i] <= 0)
+                ++nr_error;
+        free(free_sv);
+        free(free_index);
+        free(buffer);
+        return nr_error;
+    }
+
+    // Cholesky factor L of K_FF (with a ridge against duplicate SVs) and its inverse Linv; with
+    // a = K_FF^-1 1 and s = 1'a the blocks of H are K_FF^-1 - a a'/s, a/s and -1/s
+    double *L = Malloc(double,(long int)nr_free*nr_free);
+    for(j=0;j<nr_free;j++)
+        for(k=0;k<=j;k++)
+            L[(long int)j*nr_free+k] = Kernel::k_function(free_sv[j],free_sv[k],param);
+    double ridge = 0;
+    for(j=0;j<nr_free;j++)
+        ridge = max(ridge,L[(long int)j*nr_free+j]);
+    ridge *= 1e-10;
+    for(j=0;j<nr_free;j++)
+    {
+        for(k=0;k<=j;k++)
+        {
+            double sum = L[(long int)j*nr_free+k] + (j == k ? ridge : 0);
+            for(int m=0;m<k;m++)
+                sum -= L[(long int)j*nr_free+m]*L[(long int)k*nr_free+m];
+            if(j == k)
+                L[(long int)j*nr_free+j] = sqrt(max(sum,ridge));
+            else
+                L[(long int)j*nr_free+k] = sum/L[(long int)k*nr_free+k];
+        }
+    }
+    double *Linv = Malloc(double,(long int)nr_free*nr_free);
+    for(j=0;j<nr_free;j++)
+        for(k=0;k<=j;k++)
+        {
+            double sum = (j == k) ? 1 : 0;
+            for(int m=k;m<j;m++)
+                sum -= L[(long int)j*nr_free+m]*Linv[(long int)m*nr_free+k];
+            Linv[(long int)j*nr_free+k] = sum/L[(long int)j*nr_free+j];
+        }
+    // a = Linv' Linv 1, diag[k] = (K_FF^-1)_kk
+    double *z = Malloc(double,nr_free);
+    double *a = Malloc(double,nr_free);
+    double *diag = Malloc(double,nr_free);
+    for(j=0;j<nr_free;j++)
+    {
+        z[j] = 0;
+        for(k=0;k<=j;k++)
+            z[j] += Linv[(long int)j*nr_free+k];
+    }
+    double s = 0;
+    for(k=0;k<nr_free;k++)
+    {
+        a[k] = 0;
+        diag[k] = 0;
+        for(j=k;j<nr_free;j++)
+        {
+            a[k] += Linv[(long int)j*nr_free+k]*z[j];
+            diag[k] += Linv[(long int)j*nr_free+k]*Linv[(long int)j*nr_free+k];
+        }
+        s += a[k];
+    }
+
+    double nu = param.nu;
+    double *kernel = Malloc(double,nr_free);
+    for(i=0;i<l;i++)
+    {
+        double change;
+        if(free_index[i] >= 0)
+        {
+            k = free_index[i];
+            change = (nu*a[k]/s - alpha[i])/(diag[k] - a[k]*a[k]/s);
+        }
+        else
+        {
+            const svm_node *x = problem_row(prob,i,buffer);
+            double ak = 0;
+            for(k=0;k<nr_free;k++)
+            {
+                kernel[k] = Kernel::k_function(x,free_sv[k],param);
+                ak += a[k]*kernel[k];
+            }
+            change = -nu*(ak-1)/s;
+            if(alpha[i] > 0)
+            {
+                // k'K_FF^-1 k = |Linv k|^2
+                double kk = 0;
+                for(j=0;j<nr_free;j++)
+                {
+                    double sum = 0;
+                    for(k=0;k<=j;k++)
+                        sum += Linv[(long int)j*nr_free+k]*kernel[k];
+                    kk += sum*sum;
+                }
+                change += alpha[i]*(kk - (ak-1)*(ak-1)/s - Kernel::k_function(x,x,param));
+            }
+        }
+        if(dec_values[i] + change <= 0)
+            ++nr_error;
+    }
+    free(kernel);
+    free(diag);
+    free(a);
+    free(z);
+    free(Linv);
+    free(L);
+    free(free_sv);
+    free(free_index);
+    free(buffer);
+    return nr_error;
+}
+
+template <class P>
+static double svm_loo_estimate(const P *prob, const svm_model *model, const double *dec_values,
+                               svm_workspace *ws = NULL)
+{
+    int i;
+    int l = prob->l;
+    const svm_parameter& param = model->param;
+
+    double *alpha = ws_alloc<double>(ws,svm_workspace::LOO_ALPHA,l);
+    for(i=0;i<l;i++)
+        alpha[i] = 0;
+    for(i=0;i<model->l;i++)
+        alpha[model->sv_indices[i]-1] = fabs(model->sv_coef[0][i]);
+
+    int nr_error = 0;
+    if(param.svm_type == ONE_CLASS)
+        nr_error = one_class_span_errors(prob,model,dec_values,alpha);
+    else
+    {
+        double R2 = 1;
+        if(param.kernel_type != RBF)
+        {
+            svm_node *buffer = Malloc(svm_node,problem_dim(prob)+1);
+            double max_kii = 0;
+            for(i=0;i<l;i++)
+            {
+                const svm_node *x = problem_row(prob,i,buffer);
+                max_kii = max(max_kii,Kernel::k_function(x,x,param));
+            }
+            free(buffer);
+            R2 = 2*max_kii;
+        }
+        for(i=0;i<l;i++)
+        {
+            if(alpha[i] <= 0)
+                continue;
+            double y = ((int)prob->y[i] == model->label[0]) ? 1 : -1;
+            double xi = max(0.0,1-y*dec_values[i]);
+            if(2*alpha[i]*R2 + xi >= 1)
+                ++nr_error;
+        }
+    }
+    ws_release(ws,alpha);
+    return (double)nr_error/l;
+}
+
+svm_model *svm_train_ex(const svm_problem *prob, const svm_parameter *param, svm_train_info *train_info)
+{
+    double *dec_values = train_info->dec_values;
+    if(dec_values == NULL)
+        dec_values = Malloc(double,prob->l);
+    bool has_dec_values;
+    svm_workspace *ws = train_info->workspace;
+    solver_checkpoint checkpoint = {train_info->checkpoint_file,train_info->checkpoint_interval,0};
+    if(checkpoint.file != NULL)
+        checkpoint.hash = problem_hash(prob,param);
+    svm_model *model = svm_train_internal(prob,param,dec_values,&has_dec_values,ws,
+                                          checkpoint.file != NULL ? &checkpoint : NULL);
+
+    train_info->has_dec_values = has_dec_values;
+    train_info->loo_error = -1;
+    if(has_dec_values && train_info->want_loo_error)
+        train_info->loo_error = svm_loo_estimate(prob,model,dec_values,ws);
+
+    if(dec_values != train_info->dec_values)
+        free(dec_values);
+    return model;
+}
+
+svm_model *svm_train_dense(const svm_dense_problem *prob, const svm_parameter *param, svm_train_info *train_info)
+{
+    if((param->svm_type != ONE_CLASS &&
+        param->svm_type != EPSILON_SVR &&
+        param->svm_type != NU_SVR) ||
+       param->kernel_type == PRECOMPUTED || param->probability)
+        return NULL;
+
+    svm_model *model = Malloc(svm_model,1);
+    model->param = *param;
+    model->nr_class = 2;
+    model->label = NULL;
+    model->nSV = NULL;
+    model->probA = NULL; model->probB = NULL;
+    model->sv_coef = Malloc(double *,1);
+
+    double *dec_values = NULL;
+    svm_workspace *ws = NULL;
+    solver_checkpoint checkpoint = {NULL,0,0};
+    if(train_info != NULL && param->svm_type == ONE_CLASS)
+    {
+        dec_values = train_info->dec_values;
+        if(dec_values == NULL)
+            dec_values = Malloc(double,prob->l);
+        ws = train_info->workspace;
+    }
+    if(train_info != NULL)
+    {
+        checkpoint.file = train_info->checkpoint_file;
+        checkpoint.interval = train_info->checkpoint_interval;
+        if(checkpoint.file != NULL)
+            checkpoint.hash = problem_hash(prob,param);
+    }
+
+    decision_function f = svm_train_one(prob,param,0,0,dec_values,NULL,ws,
+                                        checkpoint.file != NULL ? &checkpoint : NULL);
+    fill_single_model(model,prob,f);
+    if(ws == NULL)
+        free(f.alpha);
+
+    if(train_info != NULL)
+    {
+        train_info->has_dec_values = dec_values != NULL;
+        train_info->loo_error = -1;
+        if(dec_values != NULL && train_info->want_loo_error)
+            train_info->loo_error = svm_loo_estimate(prob,model,dec_values,ws);
+        if(dec_values != train_info->dec_values)
+            free(dec_values);
+    }
+    return model;
+}
+
+svm_workspace *svm_create_workspace()
+{
+    svm_workspace *ws = Malloc(svm_workspace,1);
+    for(int b=0;b<svm_workspace::NR_BUFFER;b++)
+    {
+        ws->buffer[b] = NULL;
+        ws->size[b] = 0;
+    }
+    return ws;
+}
+
+void svm_destroy_workspace(svm_workspace *ws)
+{
+    if(ws == NULL)
+        return;
+    for(int b=0;b<svm_workspace::NR_BUFFER;b++)
+        free(ws->buffer[b]);
+    free(ws);
+}
+
+// Train one-class models along a sequence of nu (usually monotone). Every solve starts
+// from the previous alphas and all solves share one kernel cache.
+int svm_train_one_class_path(const svm_problem *prob, const svm_parameter *param,
+                             int nr_nu, const double *nu, svm_model **models)
+{
+    int i, k;
+    if(param->svm_type != ONE_CLASS || nr_nu <= 0 || prob->l <= 0)
+        return -1;
+    for(k=0;k<nr_nu;k++)
+        if(nu[k] <= 0 || nu[k] > 1)
+            return -1;
+
+    int l = prob->l;
+    double *alpha = Malloc(double,l);
+    svm_parameter subparam = *param;
+    ONE_CLASS_Q Q(*prob,*param);
+
+    for(k=0;k<nr_nu;k++)
+    {
+        Solver::SolutionInfo si;
+        si.G = NULL;
+        subparam.nu = nu[k];
+        solve_one_class(prob,&subparam,alpha,&si,&Q,k > 0 ? nu[k-1] : 0);
+        info("nu = %f, obj = %f, rho = %f\n",nu[k],si.obj,si.rho);
+
+        int nBSV = 0;
+        for(i=0;i<l;i++)
+            if(alpha[i] >= si.upper_bound_p)
+                ++nBSV;
+        info("nBSV = %d\n",nBSV);
+
+        svm_model *model = Malloc(svm_model,1);
+        model->param = subparam;
+        model->free_sv = 0;	// XXX
+        model->nr_class = 2;
+        model->label = NULL;
+        model->nSV = NULL;
+        model->probA = NULL; model->probB = NULL;
+        model->sv_coef = Malloc(double *,1);
+
+        decision_function f;
+        f.alpha = alpha;
+        f.rho = si.rho;
+        fill_single_model(model,prob,f);
+        models[k] = model;
+    }
+
+    free(alpha);
+    return 0;
+}
+
+// uniform in [0,n): from rng if given, otherwise from rand()
+static int random_below(std::mt19937 *rng, int n)
+{
+    if(rng != NULL)
+        return (int)((*rng)()%n);
+    return rand()%n;
+}
+
 // Stratified cross validation
 void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, int nr_fold, double *target)
+{
+    cross_validation(prob,param,nr_fold,target,NULL);
+}
+
+// the folds are trained in parallel, each with a share of the kernel cache
+static void cross_validation(const svm_problem *prob, const svm_parameter *param, int nr_fold,
+                             double *target, std::mt19937 *rng)
 {
     int i;
     int *fold_start;
@@ -2368,7 +3797,7 @@ void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, i
         for (c=0; c<nr_class; c++)
             for(i=0;i<count[c];i++)
             {
-                int j = i+rand()%(count[c]-i);
+                int j = i+random_below(rng,count[c]-i);
                 swap(index[start[c]+j],index[start[c]+i]);
             }
         for(i=0;i<nr_fold;i++)
@@ -2402,236 +3831,1379 @@ void svm_cross_validation(const svm_problem *prob, const svm_parameter *param, i
     }
     else
     {
-        for(i=0;i<l;i++) perm[i]=i;
-        for(i=0;i<l;i++)
+        for(i=0;i<l;i++) perm[i]=i;
+        for(i=0;i<l;i++)
+        {
+            int j = i+random_below(rng,l-i);
+            swap(perm[i],perm[j]);
+        }
+        for(i=0;i<=nr_fold;i++)
+            fold_start[i]=i*l/nr_fold;
+    }
+
+    int nr_thread = svm_thread_num(param->nr_thread);
+    nr_thread = min(nr_thread,nr_fold);
+    svm_parameter subparam = *param;
+    subparam.nr_thread = 1;
+    subparam.cache_size = param->cache_size/nr_thread;
+    parallel_for(nr_fold,nr_thread,[&](int i) {
+        int begin = fold_start[i];
+        int end = fold_start[i+1];
+        int j,k;
+        struct svm_problem subprob;
+
+        subprob.l = l-(end-begin);
+        subprob.x = Malloc(struct svm_node*,subprob.l);
+        subprob.y = Malloc(double,subprob.l);
+
+        k=0;
+        for(j=0;j<begin;j++)
+        {
+            subprob.x[k] = prob->x[perm[j]];
+            subprob.y[k] = prob->y[perm[j]];
+            ++k;
+        }
+        for(j=end;j<l;j++)
+        {
+            subprob.x[k] = prob->x[perm[j]];
+            subprob.y[k] = prob->y[perm[j]];
+            ++k;
+        }
+        struct svm_model *submodel = svm_train(&subprob,&subparam);
+        if(param->probability &&
+           (param->svm_type == C_SVC || param->svm_type == NU_SVC))
+        {
+            double *prob_estimates=Malloc(double,svm_get_nr_class(submodel));
+            for(j=begin;j<end;j++)
+                target[perm[j]] = svm_predict_probability(submodel,prob->x[perm[j]],prob_estimates);
+            free(prob_estimates);
+        }
+        else
+            for(j=begin;j<end;j++)
+                target[perm[j]] = svm_predict(submodel,prob->x[perm[j]]);
+        svm_free_and_destroy_model(&submodel);
+        free(subprob.x);
+        free(subprob.y);
+    });
+    free(fold_start);
+    free(perm);
+}
+
+
+int svm_get_svm_type(const svm_model *model)
+{
+    return model->param.svm_type;
+}
+
+int svm_get_nr_class(const svm_model *model)
+{
+    return model->nr_class;
+}
+
+void svm_get_labels(const svm_model *model, int* label)
+{
+    if (model->label != NULL)
+        for(int i=0;i<model->nr_class;i++)
+            label[i] = model->label[i];
+}
+
+void svm_get_sv_indices(const svm_model *model, int* indices)
+{
+    if (model->sv_indices != NULL)
+        for(int i=0;i<model->l;i++)
+            indices[i] = model->sv_indices[i];
+}
+
+int svm_get_nr_sv(const svm_model *model)
+{
+    return model->l;
+}
+
+double svm_get_svr_probability(const svm_model *model)
+{
+    if ((model->param.svm_type == EPSILON_SVR || model->param.svm_type == NU_SVR) &&
+        model->probA!=NULL)
+        return model->probA[0];
+    else
+    {
+        fprintf(stderr,"Model doesn't contain information for SVR probability inference\n");
+        return 0;
+    }
+}
+
+double svm_predict_values(const svm_model *model, const svm_node *x, double* dec_values)
+{
+    return svm_predict_values_ws(model,x,dec_values,NULL);
+}
+
+double svm_predict_values_ws(const svm_model *model, const svm_node *x, double* dec_values, svm_workspace *ws)
+{
+    int i;
+    if(model->param.svm_type == ONE_CLASS ||
+       model->param.svm_type == EPSILON_SVR ||
+       model->param.svm_type == NU_SVR)
+    {
+        double *sv_coef = model->sv_coef[0];
+        double sum = 0;
+        for(i=0;i<model->l;i++)
+            sum += sv_coef[i] * Kernel::k_function(x,model->SV[i],model->param);
+        sum -= model->rho[0];
+        *dec_values = sum;
+
+        if(model->param.svm_type == ONE_CLASS)
+            return (sum>0)?1:-1;
+        else
+            return sum;
+    }
+    else
+    {
+        int nr_class = model->nr_class;
+        int l = model->l;
+
+        double *kvalue = ws_alloc<double>(ws,svm_workspace::KVALUE,l);
+        for(i=0;i<l;i++)
+            kvalue[i] = Kernel::k_function(x,model->SV[i],model->param);
+
+        int *start = ws_alloc<int>(ws,svm_workspace::START,nr_class);
+        start[0] = 0;
+        for(i=1;i<nr_class;i++)
+            start[i] = start[i-1]+model->nSV[i-1];
+
+        int *vote = ws_alloc<int>(ws,svm_workspace::VOTE,nr_class);
+        for(i=0;i<nr_class;i++)
+            vote[i] = 0;
+
+        int p=0;
+        for(i=0;i<nr_class;i++)
+            for(int j=i+1;j<nr_class;j++)
+            {
+                double sum = 0;
+                int si = start[i];
+                int sj = start[j];
+                int ci = model->nSV[i];
+                int cj = model->nSV[j];
+
+                int k;
+                double *coef1 = model->sv_coef[j-1];
+                double *coef2 = model->sv_coef[i];
+                for(k=0;k<ci;k++)
+                    sum += coef1[si+k] * kvalue[si+k];
+                for(k=0;k<cj;k++)
+                    sum += coef2[sj+k] * kvalue[sj+k];
+                sum -= model->rho[p];
+                dec_values[p] = sum;
+
+                if(dec_values[p] > 0)
+                    ++vote[i];
+                else
+                    ++vote[j];
+                p++;
+            }
+
+        int vote_max_idx = 0;
+        for(i=1;i<nr_class;i++)
+            if(vote[i] > vote[vote_max_idx])
+                vote_max_idx = i;
+
+        ws_release(ws,kvalue);
+        ws_release(ws,start);
+        ws_release(ws,vote);
+        return model->label[vote_max_idx];
+    }
+}
+
+double svm_predict(const svm_model *model, const svm_node *x)
+{
+    return svm_predict_ws(model,x,NULL);
+}
+
+double svm_predict_ws(const svm_model *model, const svm_node *x, svm_workspace *ws)
+{
+    int nr_class = model->nr_class;
+    double *dec_values;
+    if(model->param.svm_type == ONE_CLASS ||
+       model->param.svm_type == EPSILON_SVR ||
+       model->param.svm_type == NU_SVR)
+        dec_values = ws_alloc<double>(ws,svm_workspace::DEC_VALUES,1);
+    else
+        dec_values = ws_alloc<double>(ws,svm_workspace::DEC_VALUES,nr_class*(nr_class-1)/2);
+    double pred_result = svm_predict_values_ws(model, x, dec_values, ws);
+    ws_release(ws,dec_values);
+    return pred_result;
+}
+
+double svm_predict_probability(
+        const svm_model *model, const svm_node *x, double *prob_estimates)
+{
+    return svm_predict_probability_ws(model,x,prob_estimates,NULL);
+}
+
+double svm_predict_probability_ws(
+        const svm_model *model, const svm_node *x, double *prob_estimates, svm_workspace *ws)
+{
+    if ((model->param.svm_type == C_SVC || model->param.svm_type == NU_SVC) &&
+        model->probA!=NULL && model->probB!=NULL)
+    {
+        int nr_class = model->nr_class;
+        int nr_pair = nr_class*(nr_class-1)/2;
+        double *dec_values = ws_alloc<double>(ws,svm_workspace::DEC_VALUES,nr_pair);
+        svm_predict_values_ws(model, x, dec_values, ws);
+
+        // the pairwise probabilities overwrite the decision values
+        sigmoid_predict(nr_pair,dec_values,model->probA,model->probB,1e-7,dec_values);
+        int prob_max_idx = pairwise_coupling(nr_class,dec_values,prob_estimates,ws);
+        ws_release(ws,dec_values);
+        return model->label[prob_max_idx];
+    }
+    else
+        return svm_predict_ws(model, x, ws);
+}
+
+//
+// compiled model: the SVs in one aligned block of tiles of COMPILED_TILE vectors, feature-major
+// inside a tile, so that x.sv for a whole tile runs over contiguous memory; with ||sv||^2 stored
+// the RBF kernel is exp(-gamma*(||x||^2+||sv||^2-2*x.sv)). The SVs of single decision models are
+// ordered by decreasing |sv_coef|, so that svm_compiled_predict_label can stop early. Both change
+// the rounding: decision values equal those of svm_predict_values up to rounding, not bit for bit
+//
+#define COMPILED_TILE 64
+
+struct svm_compiled_model
+{
+    int svm_type;
+    int kernel_type;
+    int degree;
+    double gamma;
+    double coef0;
+    int nr_class;
+    int l;			/* #SV */
+    int dim;		/* largest feature index of the SVs */
+    int nr_tile;
+    double *sv;		/* feature d of SV t*COMPILED_TILE+k at sv[(t*dim+d)*COMPILED_TILE+k], 0 past l */
+    double *sv_square;	/* ||sv||^2 */
+    double *shift;	/* NULL, or the scaler of a scaled model: feature d < dim of x is scored */
+    double *scale;	/* as (x[d]-shift[d])/scale[d] */
+    double *coef;	/* sv_coef[c][i] at coef[c*nr_tile*COMPILED_TILE+i], 0 past l */
+    double *tail_lower;	/* bounds of the sum of coef*K over tiles t... for K in [0,1] (RBF) */
+    double *tail_upper;
+    double *rho;
+    double *probA;	/* pairwise sigmoids, classification models with probability information only */
+    double *probB;
+    int *label;		/* classification only */
+    int *start;		/* first SV of each class, classification only */
+    int *nSV;
+};
+
+static inline bool is_single_decision(int svm_type)
+{
+    return svm_type == ONE_CLASS || svm_type == EPSILON_SVR || svm_type == NU_SVR;
+}
+
+static double *aligned_zeros(long int n)
+{
+    size_t size = (sizeof(double)*max(n,1L)+63)/64*64;
+    double *p = (double *)aligned_alloc(64,size);
+    memset(p,0,size);
+    return p;
+}
+
+svm_compiled_model *svm_compile_model(const svm_model *model)
+{
+    if(model == NULL || model->param.kernel_type == PRECOMPUTED)
+        return NULL;
+    int i, c;
+    int l = model->l;
+    int nr_class = model->nr_class;
+    bool single = is_single_decision(model->param.svm_type);
+    int nr_coef = single ? 1 : nr_class-1;
+    int nr_pair = single ? 1 : nr_class*(nr_class-1)/2;
+
+    svm_compiled_model *cm = Malloc(svm_compiled_model,1);
+    cm->svm_type = model->param.svm_type;
+    cm->kernel_type = model->param.kernel_type;
+    cm->degree = model->param.degree;
+    cm->gamma = model->param.gamma;
+    cm->coef0 = model->param.coef0;
+    cm->nr_class = nr_class;
+    cm->l = l;
+    cm->dim = 0;
+    for(i=0;i<l;i++)
+        for(const svm_node *p=model->SV[i];p->index!=-1;p++)
+            cm->dim = max(cm->dim,p->index);
+    cm->nr_tile = (l+COMPILED_TILE-1)/COMPILED_TILE;
+    long int size = (long int)cm->nr_tile*COMPILED_TILE;
+    cm->sv = aligned_zeros(size*cm->dim);
+    cm->sv_square = aligned_zeros(size);
+    cm->coef = aligned_zeros(size*nr_coef);
+    int *order = Malloc(int,l);
+    for(i=0;i<l;i++)
+        order[i] = i;
+    if(single)
+        std::stable_sort(order,order+l,[model](int a, int b) {
+            return fabs(model->sv_coef[0][a]) > fabs(model->sv_coef[0][b]);
+        });
+    for(i=0;i<l;i++)
+    {
+        double *sv = &cm->sv[(long int)(i/COMPILED_TILE)*cm->dim*COMPILED_TILE+i%COMPILED_TILE];
+        for(const svm_node *p=model->SV[order[i]];p->index!=-1;p++)
+            if(p->index > 0)
+            {
+                sv[(long int)(p->index-1)*COMPILED_TILE] = p->value;
+                cm->sv_square[i] += p->value*p->value;
+            }
+        for(c=0;c<nr_coef;c++)
+            cm->coef[c*size+i] = model->sv_coef[c][order[i]];
+    }
+    free(order);
+    cm->tail_lower = Malloc(double,cm->nr_tile+1);
+    cm->tail_upper = Malloc(double,cm->nr_tile+1);
+    cm->tail_lower[cm->nr_tile] = 0;
+    cm->tail_upper[cm->nr_tile] = 0;
+    for(int t=cm->nr_tile-1;t>=0;t--)
+    {
+        cm->tail_lower[t] = cm->tail_lower[t+1];
+        cm->tail_upper[t] = cm->tail_upper[t+1];
+        for(i=t*COMPILED_TILE;i<(t+1)*COMPILED_TILE;i++)
+            if(cm->coef[i] < 0)
+                cm->tail_lower[t] += cm->coef[i];
+            else
+                cm->tail_upper[t] += cm->coef[i];
+    }
+    cm->rho = Malloc(double,nr_pair);
+    memcpy(cm->rho,model->rho,sizeof(double)*nr_pair);
+    cm->shift = NULL;
+    cm->scale = NULL;
+    cm->probA = NULL;
+    cm->probB = NULL;
+    if(!single && model->probA != NULL && model->probB != NULL)
+    {
+        cm->probA = Malloc(double,nr_pair);
+        cm->probB = Malloc(double,nr_pair);
+        memcpy(cm->probA,model->probA,sizeof(double)*nr_pair);
+        memcpy(cm->probB,model->probB,sizeof(double)*nr_pair);
+    }
+    cm->label = NULL;
+    cm->start = NULL;
+    cm->nSV = NULL;
+    if(!single)
+    {
+        cm->label = Malloc(int,nr_class);
+        cm->start = Malloc(int,nr_class);
+        cm->nSV = Malloc(int,nr_class);
+        for(i=0;i<nr_class;i++)
+        {
+            cm->label[i] = model->label[i];
+            cm->nSV[i] = model->nSV[i];
+        }
+        cm->start[0] = 0;
+        for(i=1;i<nr_class;i++)
+            cm->start[i] = cm->start[i-1]+cm->nSV[i-1];
+    }
+    return cm;
+}
+
+void svm_free_compiled_model(svm_compiled_model **cm_ptr_ptr)
+{
+    if(cm_ptr_ptr == NULL || *cm_ptr_ptr == NULL)
+        return;
+    svm_compiled_model *cm = *cm_ptr_ptr;
+    free(cm->sv);
+    free(cm->sv_square);
+    free(cm->shift);
+    free(cm->scale);
+    free(cm->coef);
+    free(cm->tail_lower);
+    free(cm->tail_upper);
+    free(cm->rho);
+    free(cm->probA);
+    free(cm->probB);
+    free(cm->label);
+    free(cm->start);
+    free(cm->nSV);
+    free(cm);
+    *cm_ptr_ptr = NULL;
+}
+
+// kvalue[k] = K(x,sv) for the SVs of tile t from kvalue[k] = x.sv
+static inline void compiled_tile_kernel_of_dot(const svm_compiled_model *cm, int t, double x_square, double *kvalue)
+{
+    int k;
+    const double *sv_square = &cm->sv_square[t*COMPILED_TILE];
+    switch(cm->kernel_type)
+    {
+        case POLY:
+            for(k=0;k<COMPILED_TILE;k++)
+                kvalue[k] = svm_powi(cm->gamma*kvalue[k]+cm->coef0,cm->degree);
+            break;
+        case RBF:
+            for(k=0;k<COMPILED_TILE;k++)
+                kvalue[k] = exp(-cm->gamma*(x_square+sv_square[k]-2*kvalue[k]));
+            break;
+        case SIGMOID:
+            for(k=0;k<COMPILED_TILE;k++)
+                kvalue[k] = tanh(cm->gamma*kvalue[k]+cm->coef0);
+            break;
+        default:
+            break;
+    }
+}
+
+// kvalue[k] = K(x,sv) for the SVs of tile t; dim = min(n,cm->dim)
+static inline void compiled_tile_kernel(const svm_compiled_model *cm, int t, const double *x, int dim,
+                                        double x_square, double *kvalue)
+{
+    int k, d;
+    const double *sv = &cm->sv[(long int)t*cm->dim*COMPILED_TILE];
+    for(k=0;k<COMPILED_TILE;k++)
+        kvalue[k] = 0;
+    if(cm->shift == NULL)
+        for(d=0;d<dim;d++)
+        {
+            double xd = x[d];
+            const double *column = &sv[d*COMPILED_TILE];
+            for(k=0;k<COMPILED_TILE;k++)
+                kvalue[k] += xd*column[k];
+        }
+    else
+    {
+        // scaled model: x scaled a block of features at a time, the block division vectorizes
+        double z[COMPILED_TILE];
+        for(int d0=0;d0<dim;d0+=COMPILED_TILE)
+        {
+            int end = min(dim,d0+COMPILED_TILE);
+            for(d=d0;d<end;d++)
+                z[d-d0] = (x[d]-cm->shift[d])/cm->scale[d];
+            for(d=d0;d<end;d++)
+            {
+                double xd = z[d-d0];
+                const double *column = &sv[d*COMPILED_TILE];
+                for(k=0;k<COMPILED_TILE;k++)
+                    kvalue[k] += xd*column[k];
+            }
+        }
+    }
+    compiled_tile_kernel_of_dot(cm,t,x_square,kvalue);
+}
+
+// adds the terms of the SVs of tile t, with kernel values kvalue, to the decision value sums
+static inline void compiled_tile_sum(const svm_compiled_model *cm, int t, const double *kvalue, double *dec_values)
+{
+    int i, j, k;
+    int nr_class = cm->nr_class;
+    if(is_single_decision(cm->svm_type))
+    {
+        const double *coef = &cm->coef[t*COMPILED_TILE];
+        double sum = 0;
+        for(k=0;k<COMPILED_TILE;k++)
+            sum += coef[k]*kvalue[k];
+        dec_values[0] += sum;
+        return;
+    }
+    long int size = (long int)cm->nr_tile*COMPILED_TILE;
+    int begin = t*COMPILED_TILE;
+    int end = min(cm->l,begin+COMPILED_TILE);
+    int p = 0;
+    for(i=0;i<nr_class;i++)
+        for(j=i+1;j<nr_class;j++)
+        {
+            const double *coef1 = &cm->coef[(j-1)*size];
+            const double *coef2 = &cm->coef[i*size];
+            double sum = 0;
+            for(k=max(cm->start[i],begin);k<min(cm->start[i]+cm->nSV[i],end);k++)
+                sum += coef1[k]*kvalue[k-begin];
+            for(k=max(cm->start[j],begin);k<min(cm->start[j]+cm->nSV[j],end);k++)
+                sum += coef2[k]*kvalue[k-begin];
+            dec_values[p++] += sum;
+        }
+}
+
+// label from the sums of compiled_tile_sum over all tiles, which become the decision values
+static inline double compiled_decision_label(const svm_compiled_model *cm, double *dec_values)
+{
+    int i, j;
+    int nr_class = cm->nr_class;
+    bool single = is_single_decision(cm->svm_type);
+    int nr_pair = single ? 1 : nr_class*(nr_class-1)/2;
+    for(i=0;i<nr_pair;i++)
+        dec_values[i] -= cm->rho[i];
+    if(cm->svm_type == ONE_CLASS)
+        return (dec_values[0]>0)?1:-1;
+    if(single)
+        return dec_values[0];
+
+    // votes of each class counted from its row and column of the pairs, without a vote array
+    int vote_max_idx = 0, vote_max = -1;
+    for(i=0;i<nr_class;i++)
+    {
+        int vote = 0;
+        for(j=0;j<nr_class;j++)
+            if(j > i)
+                vote += dec_values[i*nr_class-i*(i+1)/2+j-i-1] > 0;
+            else if(j < i)
+                vote += dec_values[j*nr_class-j*(j+1)/2+i-j-1] <= 0;
+        if(vote > vote_max)
+        {
+            vote_max = vote;
+            vote_max_idx = i;
+        }
+    }
+    return cm->label[vote_max_idx];
+}
+
+// decision values and label of one row given tile_kernel(t,kvalue), which fills the kernel values
+// of the SVs of tile t
+template <class TileKernel>
+static inline double compiled_decision_values(const svm_compiled_model *cm, double *dec_values, TileKernel tile_kernel)
+{
+    int nr_pair = is_single_decision(cm->svm_type) ? 1 : cm->nr_class*(cm->nr_class-1)/2;
+    for(int i=0;i<nr_pair;i++)
+        dec_values[i] = 0;
+    double kvalue[COMPILED_TILE];
+    for(int t=0;t<cm->nr_tile;t++)
+    {
+        tile_kernel(t,kvalue);
+        compiled_tile_sum(cm,t,kvalue,dec_values);
+    }
+    return compiled_decision_label(cm,dec_values);
+}
+
+// ||x||^2, of the scaled x for a scaled model
+static inline double compiled_x_square(const svm_compiled_model *cm, const double *x, int n)
+{
+    double x_square = 0;
+    int d = 0;
+    if(cm->shift != NULL)
+        for(;d<min(n,cm->dim);d++)
+        {
+            double xd = (x[d]-cm->shift[d])/cm->scale[d];
+            x_square += xd*xd;
+        }
+    for(;d<n;d++)
+        x_square += x[d]*x[d];
+    return x_square;
+}
+
+svm_compiled_model *svm_compile_scaled_model(const svm_model *model, const double *shift, const double *scale, int n)
+{
+    if(model == NULL || model->param.kernel_type != RBF)
+        return NULL;
+    int d;
+    for(d=0;d<n;d++)
+        if(!(scale[d] != 0))
+            return NULL;
+    svm_compiled_model *cm = svm_compile_model(model);
+    if(cm->dim > n)
+    {
+        svm_free_compiled_model(&cm);
+        return NULL;
+    }
+
+    // the SVs stay those of the scaled space and x is scaled feature by feature as it is read, exactly
+    // as the scaler would, so that large shifts do not cancel against the SVs; only the tiles are
+    // widened to n features
+    long int size = (long int)cm->nr_tile*COMPILED_TILE;
+    double *sv = aligned_zeros(size*n);
+    for(int t=0;t<cm->nr_tile;t++)
+        for(d=0;d<cm->dim;d++)
+            memcpy(&sv[((long int)t*n+d)*COMPILED_TILE],&cm->sv[((long int)t*cm->dim+d)*COMPILED_TILE],
+                   sizeof(double)*COMPILED_TILE);
+    cm->shift = Malloc(double,max(n,1));
+    cm->scale = Malloc(double,max(n,1));
+    memcpy(cm->shift,shift,sizeof(double)*n);
+    memcpy(cm->scale,scale,sizeof(double)*n);
+    free(cm->sv);
+    cm->sv = sv;
+    cm->dim = n;
+    return cm;
+}
+
+double svm_compiled_predict_values(const svm_compiled_model *cm, const double *x, int n, double *dec_values)
+{
+    int dim = min(n,cm->dim);
+    double x_square = compiled_x_square(cm,x,n);
+    return compiled_decision_values(cm,dec_values,[&](int t, double *kvalue) {
+        compiled_tile_kernel(cm,t,x,dim,x_square,kvalue);
+    });
+}
+
+// rows per tile of svm_compiled_predict_values_batch: every SV tile is read once for this many
+// rows, while it and the rows stay in L1
+#define COMPILED_ROW_TILE 16
+
+void svm_compiled_predict_values_batch(const svm_compiled_model *cm, const double *x, int nr_row, int n,
+                                       double *labels, double *dec_values)
+{
+    int i, r, t;
+    int dim = min(n,cm->dim);
+    int nr_pair = is_single_decision(cm->svm_type) ? 1 : cm->nr_class*(cm->nr_class-1)/2;
+    double x_square[COMPILED_ROW_TILE];
+    double kvalue[COMPILED_TILE];
+    for(int r0=0;r0<nr_row;r0+=COMPILED_ROW_TILE)
+    {
+        int end = min(nr_row,r0+COMPILED_ROW_TILE);
+        for(r=r0;r<end;r++)
+        {
+            x_square[r-r0] = compiled_x_square(cm,&x[(long int)r*n],n);
+            for(i=0;i<nr_pair;i++)
+                dec_values[(long int)r*nr_pair+i] = 0;
+        }
+        // the same tile sums in the same order as svm_compiled_predict_values
+        for(t=0;t<cm->nr_tile;t++)
+            for(r=r0;r<end;r++)
+            {
+                compiled_tile_kernel(cm,t,&x[(long int)r*n],dim,x_square[r-r0],kvalue);
+                compiled_tile_sum(cm,t,kvalue,&dec_values[(long int)r*nr_pair]);
+            }
+        for(r=r0;r<end;r++)
+            labels[r] = compiled_decision_label(cm,&dec_values[(long int)r*nr_pair]);
+    }
+}
+
+double svm_compiled_predict_probability(const svm_compiled_model *cm, const double *x, int n,
+                                        double *prob_estimates, svm_workspace *ws)
+{
+    double label;
+    svm_compiled_predict_probability_batch(cm,x,1,n,&label,prob_estimates,ws);
+    return label;
+}
+
+void svm_compiled_predict_probability_batch(const svm_compiled_model *cm, const double *x, int nr_row, int n,
+                                            double *labels, double *prob_estimates, svm_workspace *ws)
+{
+    int i, r;
+    int nr_class = cm->nr_class;
+    int nr_pair = is_single_decision(cm->svm_type) ? 1 : nr_class*(nr_class-1)/2;
+    double *dec_values = ws_alloc<double>(ws,svm_workspace::DEC_VALUES,(long int)nr_row*nr_pair);
+    svm_compiled_predict_values_batch(cm,x,nr_row,n,labels,dec_values);
+    if(cm->probA != NULL)
+    {
+        // the pairwise probabilities overwrite the decision values
+        for(r=0;r<nr_row;r++)
+        {
+            sigmoid_predict(nr_pair,&dec_values[(long int)r*nr_pair],cm->probA,cm->probB,1e-7,
+                            &dec_values[(long int)r*nr_pair]);
+            i = pairwise_coupling(nr_class,&dec_values[(long int)r*nr_pair],&prob_estimates[(long int)r*nr_class],ws);
+            labels[r] = cm->label[i];
+        }
+    }
+    ws_release(ws,dec_values);
+}
+
+double svm_compiled_predict_label(const svm_compiled_model *cm, const double *x, int n)
+{
+    if(cm->svm_type != ONE_CLASS || cm->kernel_type != RBF)
+    {
+        int nr_pair = is_single_decision(cm->svm_type) ? 1 : cm->nr_class*(cm->nr_class-1)/2;
+        double buffer[COMPILED_TILE];
+        double *dec_values = nr_pair <= COMPILED_TILE ? buffer : Malloc(double,nr_pair);
+        double label = svm_compiled_predict_values(cm,x,n,dec_values);
+        if(dec_values != buffer)
+            free(dec_values);
+        return label;
+    }
+
+    // K is in [0,1], so the tiles not summed yet add between tail_lower and tail_upper
+    int k;
+    int dim = min(n,cm->dim);
+    double x_square = compiled_x_square(cm,x,n);
+    double kvalue[COMPILED_TILE];
+    double sum = 0;
+    for(int t=0;t<cm->nr_tile;t++)
+    {
+        compiled_tile_kernel(cm,t,x,dim,x_square,kvalue);
+        const double *coef = &cm->coef[t*COMPILED_TILE];
+        double tile_sum = 0;
+        for(k=0;k<COMPILED_TILE;k++)
+            tile_sum += coef[k]*kvalue[k];
+        sum += tile_sum;
+        if(sum+cm->tail_lower[t+1]-cm->rho[0] > 0)
+            return 1;
+        if(sum+cm->tail_upper[t+1]-cm->rho[0] <= 0)
+            return -1;
+    }
+    return (sum-cm->rho[0]>0)?1:-1;
+}
+
+//
+// quantized model: a compiled model whose SV tiles are stored as int8, with a scale per feature,
+// or as fp16. int8 rows are quantized to int16 with a scale of their own and the dot products run
+// in int32 over blocks of QUANT_BLOCK features (no overflow: 32767*127*QUANT_BLOCK < 2^31), then
+// in double; fp16 SVs are widened and summed in double. ||sv||^2 is that of the quantized SVs, so
+// the RBF distance stays that of the stored vectors
+//
+#define QUANT_BLOCK 256
+
+struct svm_quantized_model
+{
+    svm_compiled_model *cm;	/* everything but the SVs, cm->sv is NULL */
+    int precision;
+    void *sv;		/* signed char, or fp16 bits in unsigned short, laid out as svm_compiled_model::sv */
+    double *scale;	/* int8: feature d of the SVs is sv*scale[d] */
+};
+
+// IEEE half precision bits of value, rounded to nearest; magnitudes are clamped to 65504 and the
+// subnormal range (below 2^-14) is flushed to zero, so that float_of_half needs no branches
+static unsigned short half_of(double value)
+{
+    float f = (float)value;
+    uint32_t bits;
+    memcpy(&bits,&f,sizeof(bits));
+    unsigned short sign = (unsigned short)((bits>>16)&0x8000);
+    f = min(fabsf(f),65504.0f);
+    if(f < 6.103515625e-05f)
+        return sign;
+    memcpy(&bits,&f,sizeof(bits));
+    return (unsigned short)(sign|((bits+0x1000-0x38000000)>>13));
+}
+
+static inline float float_of_half(unsigned short h)
+{
+    uint32_t e = h&0x7fff;
+    uint32_t bits = ((uint32_t)(h&0x8000)<<16)|(e ? (e<<13)+0x38000000 : 0);
+    float f;
+    memcpy(&f,&bits,sizeof(f));
+    return f;
+}
+
+svm_quantized_model *svm_quantize_model(const svm_model *model, int precision)
+{
+    if(precision != QUANT_INT8 && precision != QUANT_FP16)
+        return NULL;
+    svm_compiled_model *cm = svm_compile_model(model);
+    if(cm == NULL)
+        return NULL;
+    int d, k;
+    int dim = cm->dim;
+    long int size = (long int)cm->nr_tile*COMPILED_TILE;
+    svm_quantized_model *qm = Malloc(svm_quantized_model,1);
+    qm->cm = cm;
+    qm->precision = precision;
+    qm->scale = Malloc(double,max(dim,1));
+    for(k=0;k<size;k++)
+        cm->sv_square[k] = 0;
+    if(precision == QUANT_INT8)
+    {
+        signed char *sv = Malloc(signed char,max(size*dim,1L));
+        for(d=0;d<dim;d++)
+        {
+            double sv_max = 0;
+            for(long int i=0;i<size;i++)
+                sv_max = max(sv_max,fabs(cm->sv[(i/COMPILED_TILE*dim+d)*COMPILED_TILE+i%COMPILED_TILE]));
+            qm->scale[d] = sv_max > 0 ? sv_max/127 : 1;
+        }
+        for(long int i=0;i<size*dim;i++)
+        {
+            d = int(i/COMPILED_TILE%dim);
+            sv[i] = (signed char)lrint(cm->sv[i]/qm->scale[d]);
+            double value = sv[i]*qm->scale[d];
+            cm->sv_square[i/(dim*COMPILED_TILE)*COMPILED_TILE+i%COMPILED_TILE] += value*value;
+        }
+        qm->sv = sv;
+    }
+    else
+    {
+        unsigned short *sv = Malloc(unsigned short,max(size*dim,1L));
+        for(d=0;d<dim;d++)
+            qm->scale[d] = 1;
+        for(long int i=0;i<size*dim;i++)
+        {
+            sv[i] = half_of(cm->sv[i]);
+            double value = float_of_half(sv[i]);
+            cm->sv_square[i/(dim*COMPILED_TILE)*COMPILED_TILE+i%COMPILED_TILE] += value*value;
+        }
+        qm->sv = sv;
+    }
+    free(cm->sv);
+    cm->sv = NULL;
+    return qm;
+}
+
+void svm_free_quantized_model(svm_quantized_model **qm_ptr_ptr)
+{
+    if(qm_ptr_ptr == NULL || *qm_ptr_ptr == NULL)
+        return;
+    svm_quantized_model *qm = *qm_ptr_ptr;
+    svm_free_compiled_model(&qm->cm);
+    free(qm->sv);
+    free(qm->scale);
+    free(qm);
+    *qm_ptr_ptr = NULL;
+}
+
+long int svm_quantized_sv_bytes(const svm_quantized_model *qm, long int *exact_bytes)
+{
+    long int nr_value = (long int)qm->cm->nr_tile*COMPILED_TILE*qm->cm->dim;
+    if(exact_bytes != NULL)
+        *exact_bytes = nr_value*(long int)sizeof(double);
+    if(qm->precision == QUANT_INT8)
+        return nr_value+qm->cm->dim*(long int)sizeof(double);
+    return nr_value*2;
+}
+
+double svm_quantized_predict_values(const svm_quantized_model *qm, const double *x, int n, double *dec_values,
+                                    svm_workspace *ws)
+{
+    const svm_compiled_model *cm = qm->cm;
+    int d, k;
+    int dim = min(n,cm->dim);
+    double x_square = compiled_x_square(cm,x,n);
+
+    if(qm->precision == QUANT_INT8)
+    {
+        int *xq = ws_alloc<int>(ws,svm_workspace::QUANT_X,dim);
+        double x_max = 0;
+        for(d=0;d<dim;d++)
+            x_max = max(x_max,fabs(x[d]*qm->scale[d]));
+        double x_scale = x_max > 0 ? x_max/32767 : 1;
+        for(d=0;d<dim;d++)
+            xq[d] = (int)lrint(x[d]*qm->scale[d]/x_scale);
+        const signed char *sv_all = (const signed char *)qm->sv;
+        double label = compiled_decision_values(cm,dec_values,[&](int t, double *kvalue) {
+            const signed char *sv = &sv_all[(long int)t*cm->dim*COMPILED_TILE];
+            int acc[COMPILED_TILE];
+            for(k=0;k<COMPILED_TILE;k++)
+                kvalue[k] = 0;
+            for(int d0=0;d0<dim;d0+=QUANT_BLOCK)
+            {
+                for(k=0;k<COMPILED_TILE;k++)
+                    acc[k] = 0;
+                for(d=d0;d<min(dim,d0+QUANT_BLOCK);d++)
+                {
+                    int xd = xq[d];
+                    const signed char *column = &sv[d*COMPILED_TILE];
+                    for(k=0;k<COMPILED_TILE;k++)
+                        acc[k] += xd*column[k];
+                }
+                for(k=0;k<COMPILED_TILE;k++)
+                    kvalue[k] += acc[k];
+            }
+            for(k=0;k<COMPILED_TILE;k++)
+                kvalue[k] *= x_scale;
+            compiled_tile_kernel_of_dot(cm,t,x_square,kvalue);
+        });
+        ws_release(ws,xq);
+        return label;
+    }
+    const unsigned short *sv_all = (const unsigned short *)qm->sv;
+    return compiled_decision_values(cm,dec_values,[&](int t, double *kvalue) {
+        const unsigned short *sv = &sv_all[(long int)t*cm->dim*COMPILED_TILE];
+        for(k=0;k<COMPILED_TILE;k++)
+            kvalue[k] = 0;
+        for(d=0;d<dim;d++)
+        {
+            double xd = x[d];
+            const unsigned short *column = &sv[d*COMPILED_TILE];
+            for(k=0;k<COMPILED_TILE;k++)
+                kvalue[k] += xd*float_of_half(column[k]);
+        }
+        compiled_tile_kernel_of_dot(cm,t,x_square,kvalue);
+    });
+}
+
+//
+// ball tree over the SVs of an RBF model: a node whose SVs all satisfy |sv_coef|*K(x,sv) <= epsilon,
+// by K <= exp(-gamma*max(0,|x-center|-radius)^2), is skipped as a whole
+//
+#define BALL_TREE_LEAF 16
+
+struct svm_ball_tree
+{
+    int svm_type;
+    double gamma;
+    double rho;
+    double epsilon;
+    int dim;		/* largest feature index of the SVs */
+    int nr_node;
+    double *sv;		/* SVs in leaf order, row-major l x dim */
+    double *coef;	/* sv_coef[0] in leaf order */
+    double *center;	/* nr_node x dim */
+    double *radius;
+    double *max_coef;	/* max |coef| in the node */
+    double *sum_coef;	/* sum of |coef| in the node */
+    int *begin;		/* SVs [begin,end) of the node */
+    int *end;
+    int *left;		/* children, -1 for a leaf */
+    int *right;
+};
+
+// squared distance between x (n features) and a point of dim features
+static inline double dense_distance(const double *x, int n, const double *y, int dim)
+{
+    int d;
+    double sum = 0;
+    for(d=0;d<min(n,dim);d++)
+        sum += (x[d]-y[d])*(x[d]-y[d]);
+    for(;d<dim;d++)
+        sum += y[d]*y[d];
+    for(;d<n;d++)
+        sum += x[d]*x[d];
+    return sum;
+}
+
+static int ball_tree_build_node(svm_ball_tree *tree, int *order, const double *sv, int begin, int end)
+{
+    int i, d;
+    int dim = tree->dim;
+    int node = tree->nr_node++;
+    double *center = &tree->center[(long int)node*dim];
+    for(d=0;d<dim;d++)
+        center[d] = 0;
+    for(i=begin;i<end;i++)
+        for(d=0;d<dim;d++)
+            center[d] += sv[(long int)order[i]*dim+d];
+    for(d=0;d<dim;d++)
+        center[d] /= end-begin;
+    double radius = 0;
+    for(i=begin;i<end;i++)
+        radius = max(radius,dense_distance(&sv[(long int)order[i]*dim],dim,center,dim));
+    tree->radius[node] = sqrt(radius);
+    tree->begin[node] = begin;
+    tree->end[node] = end;
+    tree->left[node] = -1;
+    tree->right[node] = -1;
+    if(end-begin <= BALL_TREE_LEAF)
+        return node;
+
+    // split at the median of the feature with the largest spread
+    int split = 0;
+    double spread = -1;
+    for(d=0;d<dim;d++)
+    {
+        double low = INF, high = -INF;
+        for(i=begin;i<end;i++)
         {
-            int j = i+rand()%(l-i);
-            swap(perm[i],perm[j]);
+            low = min(low,sv[(long int)order[i]*dim+d]);
+            high = max(high,sv[(long int)order[i]*dim+d]);
+        }
+        if(high-low > spread)
+        {
+            spread = high-low;
+            split = d;
         }
-        for(i=0;i<=nr_fold;i++)
-            fold_start[i]=i*l/nr_fold;
     }
+    int middle = (begin+end)/2;
+    std::nth_element(order+begin,order+middle,order+end,[sv,dim,split](int a, int b) {
+        return sv[(long int)a*dim+split] < sv[(long int)b*dim+split];
+    });
+    tree->left[node] = ball_tree_build_node(tree,order,sv,begin,middle);
+    tree->right[node] = ball_tree_build_node(tree,order,sv,middle,end);
+    return node;
+}
 
-    for(i=0;i<nr_fold;i++)
-    {
-        int begin = fold_start[i];
-        int end = fold_start[i+1];
-        int j,k;
-        struct svm_problem subprob;
+svm_ball_tree *svm_build_ball_tree(const svm_model *model, double epsilon)
+{
+    if(model == NULL || model->param.kernel_type != RBF || !is_single_decision(model->param.svm_type) ||
+       model->l == 0)
+        return NULL;
+    int i, j;
+    int l = model->l;
+    svm_ball_tree *tree = Malloc(svm_ball_tree,1);
+    tree->svm_type = model->param.svm_type;
+    tree->gamma = model->param.gamma;
+    tree->rho = model->rho[0];
+    tree->epsilon = epsilon;
+    tree->dim = 0;
+    for(i=0;i<l;i++)
+        for(const svm_node *p=model->SV[i];p->index!=-1;p++)
+            tree->dim = max(tree->dim,p->index);
+    int dim = tree->dim;
 
-        subprob.l = l-(end-begin);
-        subprob.x = Malloc(struct svm_node*,subprob.l);
-        subprob.y = Malloc(double,subprob.l);
+    double *sv = Malloc(double,(long int)l*dim);
+    for(i=0;i<(long int)l*dim;i++)
+        sv[i] = 0;
+    for(i=0;i<l;i++)
+        for(const svm_node *p=model->SV[i];p->index!=-1;p++)
+            if(p->index > 0)
+                sv[(long int)i*dim+p->index-1] = p->value;
+
+    int max_node = 2*l;
+    tree->nr_node = 0;
+    tree->center = Malloc(double,(long int)max_node*dim);
+    tree->radius = Malloc(double,max_node);
+    tree->max_coef = Malloc(double,max_node);
+    tree->sum_coef = Malloc(double,max_node);
+    tree->begin = Malloc(int,max_node);
+    tree->end = Malloc(int,max_node);
+    tree->left = Malloc(int,max_node);
+    tree->right = Malloc(int,max_node);
+    int *order = Malloc(int,l);
+    for(i=0;i<l;i++)
+        order[i] = i;
+    ball_tree_build_node(tree,order,sv,0,l);
 
-        k=0;
-        for(j=0;j<begin;j++)
-        {
-            subprob.x[k] = prob->x[perm[j]];
-            subprob.y[k] = prob->y[perm[j]];
-            ++k;
-        }
-        for(j=end;j<l;j++)
-        {
-            subprob.x[k] = prob->x[perm[j]];
-            subprob.y[k] = prob->y[perm[j]];
-            ++k;
-        }
-        struct svm_model *submodel = svm_train(&subprob,param);
-        if(param->probability &&
-           (param->svm_type == C_SVC || param->svm_type == NU_SVC))
+    tree->sv = Malloc(double,(long int)l*dim);
+    tree->coef = Malloc(double,l);
+    for(i=0;i<l;i++)
+    {
+        memcpy(&tree->sv[(long int)i*dim],&sv[(long int)order[i]*dim],sizeof(double)*dim);
+        tree->coef[i] = model->sv_coef[0][order[i]];
+    }
+    for(i=0;i<tree->nr_node;i++)
+    {
+        tree->max_coef[i] = 0;
+        tree->sum_coef[i] = 0;
+        for(j=tree->begin[i];j<tree->end[i];j++)
         {
-            double *prob_estimates=Malloc(double,svm_get_nr_class(submodel));
-            for(j=begin;j<end;j++)
-                target[perm[j]] = svm_predict_probability(submodel,prob->x[perm[j]],prob_estimates);
-            free(prob_estimates);
+            tree->max_coef[i] = max(tree->max_coef[i],fabs(tree->coef[j]));
+            tree->sum_coef[i] += fabs(tree->coef[j]);
         }
-        else
-            for(j=begin;j<end;j++)
-                target[perm[j]] = svm_predict(submodel,prob->x[perm[j]]);
-        svm_free_and_destroy_model(&submodel);
-        free(subprob.x);
-        free(subprob.y);
     }
-    free(fold_start);
-    free(perm);
+    free(order);
+    free(sv);
+    return tree;
 }
 
-
-int svm_get_svm_type(const svm_model *model)
+void svm_free_ball_tree(svm_ball_tree **tree_ptr_ptr)
 {
-    return model->param.svm_type;
+    if(tree_ptr_ptr == NULL || *tree_ptr_ptr == NULL)
+        return;
+    svm_ball_tree *tree = *tree_ptr_ptr;
+    free(tree->sv);
+    free(tree->coef);
+    free(tree->center);
+    free(tree->radius);
+    free(tree->max_coef);
+    free(tree->sum_coef);
+    free(tree->begin);
+    free(tree->end);
+    free(tree->left);
+    free(tree->right);
+    free(tree);
+    *tree_ptr_ptr = NULL;
 }
 
-int svm_get_nr_class(const svm_model *model)
+double svm_ball_tree_predict_values(const svm_ball_tree *tree, const double *x, int n, double *dec_value,
+                                    double *error_bound)
 {
-    return model->nr_class;
+    int dim = tree->dim;
+    double sum = 0, bound = 0;
+    // the depth of the tree is below 64 for any l that fits in an int
+    int stack[64];
+    int top = 0;
+    stack[top++] = 0;
+    while(top > 0)
+    {
+        int node = stack[--top];
+        double distance = sqrt(dense_distance(x,n,&tree->center[(long int)node*dim],dim))-tree->radius[node];
+        double max_kernel = distance > 0 ? exp(-tree->gamma*distance*distance) : 1;
+        if(tree->max_coef[node]*max_kernel <= tree->epsilon)
+        {
+            bound += tree->sum_coef[node]*max_kernel;
+            continue;
+        }
+        if(tree->left[node] >= 0)
+        {
+            stack[top++] = tree->right[node];
+            stack[top++] = tree->left[node];
+            continue;
+        }
+        for(int i=tree->begin[node];i<tree->end[node];i++)
+            sum += tree->coef[i]*exp(-tree->gamma*dense_distance(x,n,&tree->sv[(long int)i*dim],dim));
+    }
+    sum -= tree->rho;
+    if(dec_value != NULL)
+        *dec_value = sum;
+    if(error_bound != NULL)
+        *error_bound = bound;
+    if(tree->svm_type == ONE_CLASS)
+        return (sum>0)?1:-1;
+    return sum;
 }
 
-void svm_get_labels(const svm_model *model, int* label)
+//
+// improved fast Gauss transform of an RBF model: the SVs are grouped by farthest point clustering and
+// around each center c, with dx = x-c and dy = sv-c,
+//     K(x,sv) = exp(-gamma*|dx|^2) exp(-gamma*|dy|^2) sum_alpha (2*gamma)^|alpha|/alpha! dx^alpha dy^alpha
+// truncated at |alpha| < p, so the moments of each cluster are summed over its SVs once and a
+// prediction costs nr_cluster*M instead of l kernel evaluations. Clusters farther than cutoff are
+// skipped. With W = sum |sv_coef|, cutoff and truncation each add at most tolerance/2. An expansion
+// that would cost as much as l*dim, the dot products of exact summation alone, is not built
+//
+#define FGT_MAX_ORDER 20
+#define FGT_MAX_CLUSTER 2048
+#define FGT_MAX_MONOMIAL 100000
+
+struct svm_fgt
 {
-    if (model->label != NULL)
-        for(int i=0;i<model->nr_class;i++)
-            label[i] = model->label[i];
-}
+    int svm_type;
+    double gamma;
+    double rho;
+    double tolerance;
+    int dim;		/* largest feature index of the SVs */
+    int p;			/* expansion order */
+    int nr_monomial;	/* multi-indices with |alpha| < p */
+    int nr_cluster;
+    double *center;	/* nr_cluster x dim */
+    double *cutoff;	/* clusters with |x-center| > cutoff are skipped */
+    double *moment;	/* nr_cluster x nr_monomial */
+};
 
-void svm_get_sv_indices(const svm_model *model, int* indices)
+// monomial[t] = dx^alpha_t for |alpha_t| < p in graded order, dx of dim values
+static void fgt_monomials(const double *dx, int dim, int p, int *heads, double *monomial)
 {
-    if (model->sv_indices != NULL)
-        for(int i=0;i<model->l;i++)
-            indices[i] = model->sv_indices[i];
+    int i, j, k;
+    for(i=0;i<dim;i++)
+        heads[i] = 0;
+    monomial[0] = 1;
+    int t = 1, tail = 1;
+    for(k=1;k<p;k++)
+    {
+        for(i=0;i<dim;i++)
+        {
+            int head = heads[i];
+            heads[i] = t;
+            for(j=head;j<tail;j++)
+                monomial[t++] = dx[i]*monomial[j];
+        }
+        tail = t;
+    }
 }
 
-int svm_get_nr_sv(const svm_model *model)
+static double fgt_nr_monomial(int p, int dim)
 {
-    return model->l;
+    // C(p-1+dim, dim)
+    double count = 1;
+    for(int k=1;k<p;k++)
+        count = count*(dim+k)/k;
+    return count;
 }
 
-double svm_get_svr_probability(const svm_model *model)
+// truncation error per unit of |sv_coef| for |dy| <= radius and |dx| <= radius+cutoff
+static double fgt_truncation_error(int p, double gamma, double radius, double cutoff)
 {
-    if ((model->param.svm_type == EPSILON_SVR || model->param.svm_type == NU_SVR) &&
-        model->probA!=NULL)
-        return model->probA[0];
-    else
-    {
-        fprintf(stderr,"Model doesn't contain information for SVR probability inference\n");
+    if(radius <= 0)
         return 0;
-    }
+    double a = min(radius+cutoff,(radius+sqrt(radius*radius+2*p/gamma))/2);
+    return exp(p*log(2*gamma*a*radius)-lgamma(p+1.0)-gamma*(a-radius)*(a-radius));
 }
 
-double svm_predict_values(const svm_model *model, const svm_node *x, double* dec_values)
+svm_fgt *svm_build_fgt(const svm_model *model, double tolerance)
 {
-    int i;
-    if(model->param.svm_type == ONE_CLASS ||
-       model->param.svm_type == EPSILON_SVR ||
-       model->param.svm_type == NU_SVR)
+    if(model == NULL || model->param.kernel_type != RBF || !is_single_decision(model->param.svm_type) ||
+       model->l == 0 || tolerance <= 0)
+        return NULL;
+    int i, j, k, d;
+    int l = model->l;
+    double gamma = model->param.gamma;
+    int dim = 0;
+    for(i=0;i<l;i++)
+        for(const svm_node *p=model->SV[i];p->index!=-1;p++)
+            dim = max(dim,p->index);
+    double *sv = Malloc(double,(long int)l*dim);
+    for(i=0;i<(long int)l*dim;i++)
+        sv[i] = 0;
+    double weight = 0;
+    for(i=0;i<l;i++)
     {
-        double *sv_coef = model->sv_coef[0];
-        double sum = 0;
-        for(i=0;i<model->l;i++)
-            sum += sv_coef[i] * Kernel::k_function(x,model->SV[i],model->param);
-        sum -= model->rho[0];
-        *dec_values = sum;
-
-        if(model->param.svm_type == ONE_CLASS)
-            return (sum>0)?1:-1;
-        else
-            return sum;
+        for(const svm_node *p=model->SV[i];p->index!=-1;p++)
+            if(p->index > 0)
+                sv[(long int)i*dim+p->index-1] = p->value;
+        weight += fabs(model->sv_coef[0][i]);
     }
-    else
+    double target = tolerance/(2*max(weight,DBL_MIN));
+    double cutoff = sqrt(max(0.0,log(1/target))/gamma);
+
+    // farthest point clustering; the number of clusters minimizes nr_cluster*(nr_monomial+dim)
+    int max_cluster = min(l,FGT_MAX_CLUSTER);
+    int *center = Malloc(int,max_cluster);
+    int *assign = Malloc(int,l);
+    double *distance = Malloc(double,l);
+    center[0] = 0;
+    for(i=0;i<l;i++)
     {
-        int nr_class = model->nr_class;
-        int l = model->l;
-
-        double *kvalue = Malloc(double,l);
+        assign[i] = 0;
+        distance[i] = dense_distance(&sv[(long int)i*dim],dim,sv,dim);
+    }
+    int best_cluster = -1, best_p = 0;
+    double best_cost = INF;
+    for(k=1;k<=max_cluster;k++)
+    {
+        int farthest = 0;
+        for(i=1;i<l;i++)
+            if(distance[i] > distance[farthest])
+                farthest = i;
+        if(k == max_cluster || (k & (k-1)) == 0 || distance[farthest] == 0)
+        {
+            double radius = sqrt(distance[farthest]);
+            for(int p=1;p<=FGT_MAX_ORDER;p++)
+                if(fgt_truncation_error(p,gamma,radius,cutoff) <= target)
+                {
+                    double cost = k*(fgt_nr_monomial(p,dim)+dim);
+                    if(fgt_nr_monomial(p,dim) <= FGT_MAX_MONOMIAL && cost < best_cost)
+                    {
+                        best_cost = cost;
+                        best_cluster = k;
+                        best_p = p;
+                    }
+                    break;
+                }
+        }
+        if(k == max_cluster || distance[farthest] == 0)
+            break;
+        center[k] = farthest;
         for(i=0;i<l;i++)
-            kvalue[i] = Kernel::k_function(x,model->SV[i],model->param);
-
-        int *start = Malloc(int,nr_class);
-        start[0] = 0;
-        for(i=1;i<nr_class;i++)
-            start[i] = start[i-1]+model->nSV[i-1];
-
-        int *vote = Malloc(int,nr_class);
-        for(i=0;i<nr_class;i++)
-            vote[i] = 0;
-
-        int p=0;
-        for(i=0;i<nr_class;i++)
-            for(int j=i+1;j<nr_class;j++)
+        {
+            double value = dense_distance(&sv[(long int)i*dim],dim,&sv[(long int)farthest*dim],dim);
+            if(value < distance[i])
             {
-                double sum = 0;
-                int si = start[i];
-                int sj = start[j];
-                int ci = model->nSV[i];
-                int cj = model->nSV[j];
-
-                int k;
-                double *coef1 = model->sv_coef[j-1];
-                double *coef2 = model->sv_coef[i];
-                for(k=0;k<ci;k++)
-                    sum += coef1[si+k] * kvalue[si+k];
-                for(k=0;k<cj;k++)
-                    sum += coef2[sj+k] * kvalue[sj+k];
-                sum -= model->rho[p];
-                dec_values[p] = sum;
+                distance[i] = value;
+                assign[i] = k;
+            }
+        }
+    }
+    if(best_cluster < 0 || best_cost >= (double)l*dim)
+    {
+        free(sv);
+        free(center);
+        free(assign);
+        free(distance);
+        return NULL;
+    }
 
-                if(dec_values[p] > 0)
-                    ++vote[i];
-                else
-                    ++vote[j];
-                p++;
+    // the first best_cluster centers, every SV assigned to the nearest of them
+    int nr_cluster = best_cluster;
+    for(i=0;i<l;i++)
+    {
+        assign[i] = 0;
+        distance[i] = INF;
+        for(k=0;k<nr_cluster;k++)
+        {
+            double value = dense_distance(&sv[(long int)i*dim],dim,&sv[(long int)center[k]*dim],dim);
+            if(value < distance[i])
+            {
+                distance[i] = value;
+                assign[i] = k;
             }
+        }
+    }
 
-        int vote_max_idx = 0;
-        for(i=1;i<nr_class;i++)
-            if(vote[i] > vote[vote_max_idx])
-                vote_max_idx = i;
+    svm_fgt *fgt = Malloc(svm_fgt,1);
+    fgt->svm_type = model->param.svm_type;
+    fgt->gamma = gamma;
+    fgt->rho = model->rho[0];
+    fgt->tolerance = tolerance;
+    fgt->dim = dim;
+    fgt->p = best_p;
+    fgt->nr_monomial = (int)fgt_nr_monomial(best_p,dim);
+    fgt->nr_cluster = nr_cluster;
+    int nr_monomial = fgt->nr_monomial;
+    fgt->center = Malloc(double,(long int)nr_cluster*dim);
+    fgt->cutoff = Malloc(double,nr_cluster);
+    fgt->moment = Malloc(double,(long int)nr_cluster*nr_monomial);
+    for(k=0;k<nr_cluster;k++)
+    {
+        memcpy(&fgt->center[(long int)k*dim],&sv[(long int)center[k]*dim],sizeof(double)*dim);
+        fgt->cutoff[k] = 0;
+    }
+    for(i=0;i<(long int)nr_cluster*nr_monomial;i++)
+        fgt->moment[i] = 0;
+
+    // (2*gamma)^|alpha|/alpha! in the order of fgt_monomials: the exponents follow the same recursion
+    double *constant = Malloc(double,nr_monomial);
+    int *power = Malloc(int,(long int)nr_monomial*max(dim,1));
+    int *heads = Malloc(int,max(dim,1));
+    constant[0] = 1;
+    for(d=0;d<dim;d++)
+    {
+        heads[d] = 0;
+        power[d] = 0;
+    }
+    int t = 1, tail = 1;
+    for(k=1;k<best_p;k++)
+    {
+        for(d=0;d<dim;d++)
+        {
+            int head = heads[d];
+            heads[d] = t;
+            for(j=head;j<tail;j++,t++)
+            {
+                memcpy(&power[(long int)t*dim],&power[(long int)j*dim],sizeof(int)*dim);
+                power[(long int)t*dim+d]++;
+                constant[t] = constant[j]*2*gamma/power[(long int)t*dim+d];
+            }
+        }
+        tail = t;
+    }
 
-        free(kvalue);
-        free(start);
-        free(vote);
-        return model->label[vote_max_idx];
+    double *dy = Malloc(double,max(dim,1));
+    double *monomial = Malloc(double,nr_monomial);
+    for(i=0;i<l;i++)
+    {
+        k = assign[i];
+        const double *c = &fgt->center[(long int)k*dim];
+        for(d=0;d<dim;d++)
+            dy[d] = sv[(long int)i*dim+d]-c[d];
+        fgt->cutoff[k] = max(fgt->cutoff[k],sqrt(distance[i]));
+        double w = model->sv_coef[0][i]*exp(-gamma*distance[i]);
+        fgt_monomials(dy,dim,best_p,heads,monomial);
+        double *moment = &fgt->moment[(long int)k*nr_monomial];
+        for(j=0;j<nr_monomial;j++)
+            moment[j] += w*monomial[j];
+    }
+    for(k=0;k<nr_cluster;k++)
+    {
+        fgt->cutoff[k] += cutoff;
+        double *moment = &fgt->moment[(long int)k*nr_monomial];
+        for(j=0;j<nr_monomial;j++)
+            moment[j] *= constant[j];
     }
+
+    free(dy);
+    free(monomial);
+    free(constant);
+    free(power);
+    free(heads);
+    free(sv);
+    free(center);
+    free(assign);
+    free(distance);
+    return fgt;
 }
 
-double svm_predict(const svm_model *model, const svm_node *x)
+void svm_free_fgt(svm_fgt **fgt_ptr_ptr)
 {
-    int nr_class = model->nr_class;
-    double *dec_values;
-    if(model->param.svm_type == ONE_CLASS ||
-       model->param.svm_type == EPSILON_SVR ||
-       model->param.svm_type == NU_SVR)
-        dec_values = Malloc(double, 1);
-    else
-        dec_values = Malloc(double, nr_class*(nr_class-1)/2);
-    double pred_result = svm_predict_values(model, x, dec_values);
-    free(dec_values);
-    return pred_result;
+    if(fgt_ptr_ptr == NULL || *fgt_ptr_ptr == NULL)
+        return;
+    svm_fgt *fgt = *fgt_ptr_ptr;
+    free(fgt->center);
+    free(fgt->cutoff);
+    free(fgt->moment);
+    free(fgt);
+    *fgt_ptr_ptr = NULL;
 }
 
-double svm_predict_probability(
-        const svm_model *model, const svm_node *x, double *prob_estimates)
+double svm_fgt_predict_values(const svm_fgt *fgt, const double *x, int n, double *dec_value, svm_workspace *ws)
 {
-    if ((model->param.svm_type == C_SVC || model->param.svm_type == NU_SVC) &&
-        model->probA!=NULL && model->probB!=NULL)
+    int d, j;
+    int dim = fgt->dim;
+    double *dx = ws_alloc<double>(ws,svm_workspace::FGT_DX,dim);
+    double *monomial = ws_alloc<double>(ws,svm_workspace::FGT_MONOMIAL,fgt->nr_monomial);
+    int *heads = ws_alloc<int>(ws,svm_workspace::FGT_HEADS,dim);
+    double sum = 0;
+    for(int k=0;k<fgt->nr_cluster;k++)
     {
-        int i;
-        int nr_class = model->nr_class;
-        double *dec_values = Malloc(double, nr_class*(nr_class-1)/2);
-        svm_predict_values(model, x, dec_values);
-
-        double min_prob=1e-7;
-        double **pairwise_prob=Malloc(double *,nr_class);
-        for(i=0;i<nr_class;i++)
-            pairwise_prob[i]=Malloc(double,nr_class);
-        int k=0;
-        for(i=0;i<nr_class;i++)
-            for(int j=i+1;j<nr_class;j++)
-            {
-                pairwise_prob[i][j]=min(max(sigmoid_predict(dec_values[k],model->probA[k],model->probB[k]),min_prob),1-min_prob);
-                pairwise_prob[j][i]=1-pairwise_prob[i][j];
-                k++;
-            }
-        if (nr_class == 2)
-        {
-            prob_estimates[0] = pairwise_prob[0][1];
-            prob_estimates[1] = pairwise_prob[1][0];
-        }
-        else
-            multiclass_probability(nr_class,pairwise_prob,prob_estimates);
-
-        int prob_max_idx = 0;
-        for(i=1;i<nr_class;i++)
-            if(prob_estimates[i] > prob_estimates[prob_max_idx])
-                prob_max_idx = i;
-        for(i=0;i<nr_class;i++)
-            free(pairwise_prob[i]);
-        free(dec_values);
-        free(pairwise_prob);
-        return model->label[prob_max_idx];
+        const double *c = &fgt->center[(long int)k*dim];
+        double distance = dense_distance(x,n,c,dim);
+        if(distance > fgt->cutoff[k]*fgt->cutoff[k])
+            continue;
+        for(d=0;d<dim;d++)
+            dx[d] = (d < n ? x[d] : 0)-c[d];
+        fgt_monomials(dx,dim,fgt->p,heads,monomial);
+        const double *moment = &fgt->moment[(long int)k*fgt->nr_monomial];
+        double value = 0;
+        for(j=0;j<fgt->nr_monomial;j++)
+            value += moment[j]*monomial[j];
+        sum += exp(-fgt->gamma*distance)*value;
     }
-    else
-        return svm_predict(model, x);
+    ws_release(ws,dx);
+    ws_release(ws,monomial);
+    ws_release(ws,heads);
+    sum -= fgt->rho;
+    if(dec_value != NULL)
+        *dec_value = sum;
+    if(fgt->svm_type == ONE_CLASS)
+        return (sum>0)?1:-1;
+    return sum;
 }
 
 static const char *svm_type_table[] =
@@ -2644,6 +5216,53 @@ static const char *kernel_type_table[]=
                 "linear","polynomial","rbf","sigmoid","precomputed",NULL
         };
 
+// switch only the calling thread to the C locale, so that models can be saved and loaded concurrently
+#ifdef _WIN32
+#define strtok_r strtok_s
+struct thread_locale
+{
+    int mode;
+    char *name;
+};
+
+static thread_locale switch_to_c_locale()
+{
+    thread_locale old;
+    old.mode = _configthreadlocale(_ENABLE_PER_THREAD_LOCALE);
+    old.name = setlocale(LC_ALL, NULL);
+    if(old.name) old.name = _strdup(old.name);
+    setlocale(LC_ALL, "C");
+    return old;
+}
+
+static void restore_locale(thread_locale old)
+{
+    setlocale(LC_ALL, old.name);
+    free(old.name);
+    _configthreadlocale(old.mode);
+}
+#else
+struct thread_locale
+{
+    locale_t c_locale;
+    locale_t old_locale;
+};
+
+static thread_locale switch_to_c_locale()
+{
+    thread_locale old;
+    old.c_locale = newlocale(LC_ALL_MASK, "C", (locale_t)0);
+    old.old_locale = uselocale(old.c_locale);
+    return old;
+}
+
+static void restore_locale(thread_locale old)
+{
+    uselocale(old.old_locale);
+    if(old.c_locale) freelocale(old.c_locale);
+}
+#endif
+
 int svm_save_model(const char *model_file_name, const svm_model *model)
 {
     FILE *fp = fopen(model_file_name,"w");
@@ -2651,11 +5270,7 @@ int svm_save_model(const char *model_file_name, const svm_model *model)
         return -1;
     }
 
-    char *old_locale = setlocale(LC_ALL, NULL);
-    if (old_locale) {
-        old_locale = strdup(old_locale);
-    }
-    setlocale(LC_ALL, "C");
+    thread_locale old_locale = switch_to_c_locale();
 
     const svm_parameter& param = model->param;
 
@@ -2736,17 +5351,14 @@ int svm_save_model(const char *model_file_name, const svm_model *model)
         fprintf(fp, "\n");
     }
 
-    setlocale(LC_ALL, old_locale);
-    free(old_locale);
+    restore_locale(old_locale);
 
     if (ferror(fp) != 0 || fclose(fp) != 0) return -1;
     else return 0;
 }
 
-static char *line = NULL;
-static int max_line_len;
-
-static char* readline(FILE *input)
+// line and max_line_len belong to the caller, so readline is reentrant
+static char* readline(FILE *input, char *&line, int &max_line_len)
 {
     int len;
 
@@ -2779,6 +5391,9 @@ bool read_model_header(FILE *fp, svm_model* model)
     param.nr_weight = 0;
     param.weight_label = NULL;
     param.weight = NULL;
+    param.nr_thread = 1;
+    param.shared_cache = 0;
+    param.prefetch = 0;
 
     char cmd[81];
     while(1)
@@ -2891,11 +5506,7 @@ svm_model *svm_load_model(const char *model_file_name)
     FILE *fp = fopen(model_file_name,"rb");
     if(fp==NULL) return NULL;
 
-    char *old_locale = setlocale(LC_ALL, NULL);
-    if (old_locale) {
-        old_locale = strdup(old_locale);
-    }
-    setlocale(LC_ALL, "C");
+    thread_locale old_locale = switch_to_c_locale();
 
     // read parameters
 
@@ -2911,8 +5522,7 @@ svm_model *svm_load_model(const char *model_file_name)
     if (!read_model_header(fp, model))
     {
         fprintf(stderr, "ERROR: fscanf failed to read model\n");
-        setlocale(LC_ALL, old_locale);
-        free(old_locale);
+        restore_locale(old_locale);
         free(model->rho);
         free(model->label);
         free(model->nSV);
@@ -2925,16 +5535,16 @@ svm_model *svm_load_model(const char *model_file_name)
     int elements = 0;
     long pos = ftell(fp);
 
-    max_line_len = 1024;
-    line = Malloc(char,max_line_len);
-    char *p,*endptr,*idx,*val;
+    int max_line_len = 1024;
+    char *line = Malloc(char,max_line_len);
+    char *p,*endptr,*idx,*val,*save;
 
-    while(readline(fp)!=NULL)
+    while(readline(fp,line,max_line_len)!=NULL)
     {
-        p = strtok(line,":");
+        p = strtok_r(line,":",&save);
         while(1)
         {
-            p = strtok(NULL,":");
+            p = strtok_r(NULL,":",&save);
             if(p == NULL)
                 break;
             ++elements;
@@ -2957,21 +5567,21 @@ svm_model *svm_load_model(const char *model_file_name)
     int j=0;
     for(i=0;i<l;i++)
     {
-        readline(fp);
+        readline(fp,line,max_line_len);
         model->SV[i] = &x_space[j];
 
-        p = strtok(line, " \t");
+        p = strtok_r(line, " \t", &save);
         model->sv_coef[0][i] = strtod(p,&endptr);
         for(int k=1;k<m;k++)
         {
-            p = strtok(NULL, " \t");
+            p = strtok_r(NULL, " \t", &save);
             model->sv_coef[k][i] = strtod(p,&endptr);
         }
 
         while(1)
         {
-            idx = strtok(NULL, ":");
-            val = strtok(NULL, " \t");
+            idx = strtok_r(NULL, ":", &save);
+            val = strtok_r(NULL, " \t", &save);
 
             if(val == NULL)
                 break;
@@ -2984,8 +5594,7 @@ svm_model *svm_load_model(const char *model_file_name)
     }
     free(line);
 
-    setlocale(LC_ALL, old_locale);
-    free(old_locale);
+    restore_locale(old_locale);
 
     if (ferror(fp) != 0 || fclose(fp) != 0)
         return NULL;
@@ -3106,6 +5715,17 @@ const char *svm_check_parameter(const svm_problem *prob, const svm_parameter *pa
        param->probability != 1)
         return "probability != 0 and probability != 1";
 
+    if(param->nr_thread < 0 || param->nr_thread > SVM_MAX_THREAD)
+        return "nr_thread < 0 or nr_thread > SVM_MAX_THREAD";
+
+    if(param->shared_cache != 0 &&
+       param->shared_cache != 1)
+        return "shared_cache != 0 and shared_cache != 1";
+
+    if(param->prefetch != 0 &&
+       param->prefetch != 1)
+        return "prefetch != 0 and prefetch != 1";
+
     if(param->probability == 1 &&
        svm_type == ONE_CLASS)
         return "one-class SVM probability output not supported yet";
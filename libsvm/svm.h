@@ -22,8 +22,26 @@ struct svm_problem
     struct svm_node **x;
 };
 
+//
+// svm_dense_problem: a view of l instances with n dense features stored column by column
+//
+struct svm_dense_problem
+{
+    int l;
+    int n;
+    const double *y;
+    const double * const *column;	/* column[d][i]: feature d+1 of instance i */
+};
+
 enum { C_SVC, NU_SVC, ONE_CLASS, EPSILON_SVR, NU_SVR };	/* svm_type */
 enum { LINEAR, POLY, RBF, SIGMOID, PRECOMPUTED }; /* kernel_type */
+enum { QUANT_INT8, QUANT_FP16 };	/* svm_quantize_model precision */
+
+/* nr_thread, shared_cache and prefetch are not in upstream libsvm 3.24: the struct is larger and code
+   compiled against the upstream svm.h must be rebuilt, and code that fills svm_parameter field by field
+   must set them too (zero-initializing the struct keeps the upstream behaviour apart from using all
+   cores). svm_check_parameter rejects values out of range, nr_thread above SVM_MAX_THREAD included */
+#define SVM_MAX_THREAD 4096
 
 struct svm_parameter
 {
@@ -44,6 +62,11 @@ struct svm_parameter
     double p;	/* for EPSILON_SVR */
     int shrinking;	/* use the shrinking heuristics */
     int probability; /* do probability estimates */
+    int nr_thread;	/* threads for training one-vs-one pairs, 0 for all cores */
+    int shared_cache;	/* 1: one kernel cache for all one-vs-one pairs (C_SVC/NU_SVC, nr_class > 2), 0: one per pair */
+    int prefetch;	/* compute the predicted next kernel column on a helper thread (l >= 1000 and
+			   svm_thread_num(nr_thread) > 1); pays off when kernel columns are expensive
+			   (many features) and miss the cache, costs more than it saves on cheap ones */
 };
 
 //
@@ -71,7 +94,37 @@ struct svm_model
     /* 0 if svm_model is created by svm_train */
 };
 
+//
+// svm_workspace: buffers reused by a sequence of trainings or predictions on one thread
+//
+struct svm_workspace;
+
+//
+// svm_train_info: extra results of svm_train_ex
+//
+struct svm_train_info
+{
+    double *dec_values;	/* optional buffer of length l for the decision values of the training instances */
+    int has_dec_values;	/* 1 if they are available (ONE_CLASS, or C_SVC/NU_SVC with two classes) */
+    int want_loo_error;	/* 1 to compute loo_error (for one-class, a kernel row per instance over the free SVs) */
+    double loo_error;	/* leave-one-out error rate, span estimate for one-class and xi-alpha otherwise;
+			   -1 if not available or wanted */
+    struct svm_workspace *workspace;	/* optional, ONE_CLASS solves run on it (one thread at a time) */
+    const char *checkpoint_file;	/* optional, ONE_CLASS/EPSILON_SVR/NU_SVR: solver state file to resume from, */
+    int checkpoint_interval;	/* rewritten every checkpoint_interval iterations, removed when a solve that
+				   wrote or resumed from it ends */
+};
+
 struct svm_model *svm_train(const struct svm_problem *prob, const struct svm_parameter *param);
+struct svm_model *svm_train_ex(const struct svm_problem *prob, const struct svm_parameter *param,
+                               struct svm_train_info *train_info);
+/* ONE_CLASS, EPSILON_SVR and NU_SVR without probability or precomputed kernel; NULL otherwise */
+struct svm_model *svm_train_dense(const struct svm_dense_problem *prob, const struct svm_parameter *param,
+                                  struct svm_train_info *train_info);
+struct svm_workspace *svm_create_workspace(void);
+void svm_destroy_workspace(struct svm_workspace *ws);
+int svm_train_one_class_path(const struct svm_problem *prob, const struct svm_parameter *param,
+                             int nr_nu, const double *nu, struct svm_model **models);
 void svm_cross_validation(const struct svm_problem *prob, const struct svm_parameter *param, int nr_fold, double *target);
 
 int svm_save_model(const char *model_file_name, const struct svm_model *model);
@@ -87,6 +140,64 @@ double svm_get_svr_probability(const struct svm_model *model);
 double svm_predict_values(const struct svm_model *model, const struct svm_node *x, double* dec_values);
 double svm_predict(const struct svm_model *model, const struct svm_node *x);
 double svm_predict_probability(const struct svm_model *model, const struct svm_node *x, double* prob_estimates);
+/* as above with the scratch buffers taken from ws (NULL: heap), no heap allocation once ws has grown */
+double svm_predict_values_ws(const struct svm_model *model, const struct svm_node *x, double* dec_values,
+                             struct svm_workspace *ws);
+double svm_predict_ws(const struct svm_model *model, const struct svm_node *x, struct svm_workspace *ws);
+double svm_predict_probability_ws(const struct svm_model *model, const struct svm_node *x, double* prob_estimates,
+                                  struct svm_workspace *ws);
+
+/* compiled model: the SVs of a model in one aligned dense block, for fast prediction of dense rows */
+struct svm_compiled_model;
+struct svm_compiled_model *svm_compile_model(const struct svm_model *model);	/* NULL for precomputed kernels */
+void svm_free_compiled_model(struct svm_compiled_model **cm_ptr_ptr);
+/* x[d] is feature d+1, n features; dec_values as in svm_predict_values up to rounding (RBF goes through
+   ||x||^2+||sv||^2-2*x.sv, and single-decision models sum their SVs largest |coef| first) */
+double svm_compiled_predict_values(const struct svm_compiled_model *cm, const double *x, int n, double *dec_values);
+/* svm_compiled_predict_values of nr_row rows x[r*n...], bit for bit, into labels[r] and
+   dec_values[r*nr_pair...]; every tile of SVs is scored against a tile of rows at a time */
+void svm_compiled_predict_values_batch(const struct svm_compiled_model *cm, const double *x, int nr_row, int n,
+                                       double *labels, double *dec_values);
+/* label only; one-class RBF models stop summing as soon as the sign of the decision value is certain */
+double svm_compiled_predict_label(const struct svm_compiled_model *cm, const double *x, int n);
+/* RBF model trained on (x[d]-shift[d])/scale[d], d < n, compiled to score the unscaled x directly: x is scaled
+   feature by feature inside the kernel, so the decision values are those of the compiled model on the scaled
+   row; NULL for other kernels, zero scales or SVs with more than n features */
+struct svm_compiled_model *svm_compile_scaled_model(const struct svm_model *model, const double *shift,
+                                                    const double *scale, int n);
+/* as svm_predict_probability; prob_estimates is left alone unless the model is a classifier with probability
+   information. The batch form scores nr_row rows x[r*n...], prob_estimates[r*nr_class+c] */
+double svm_compiled_predict_probability(const struct svm_compiled_model *cm, const double *x, int n,
+                                        double *prob_estimates, struct svm_workspace *ws);
+void svm_compiled_predict_probability_batch(const struct svm_compiled_model *cm, const double *x, int nr_row, int n,
+                                            double *labels, double *prob_estimates, struct svm_workspace *ws);
+
+/* compiled model with the SVs stored as int8 (a scale per feature, dot products in int32) or fp16, the kernel
+   values summed in double; NULL for precomputed kernels */
+struct svm_quantized_model;
+struct svm_quantized_model *svm_quantize_model(const struct svm_model *model, int precision);
+void svm_free_quantized_model(struct svm_quantized_model **qm_ptr_ptr);
+double svm_quantized_predict_values(const struct svm_quantized_model *qm, const double *x, int n, double *dec_values,
+                                    struct svm_workspace *ws);
+/* bytes of the quantized SV matrix; *exact_bytes (if not NULL) those of the compiled one */
+long int svm_quantized_sv_bytes(const struct svm_quantized_model *qm, long int *exact_bytes);
+
+/* ball tree over the SVs of an RBF one-class or regression model; NULL for other models */
+struct svm_ball_tree;
+struct svm_ball_tree *svm_build_ball_tree(const struct svm_model *model, double epsilon);
+void svm_free_ball_tree(struct svm_ball_tree **tree_ptr_ptr);
+/* skips the SVs with |sv_coef|*K(x,sv) <= epsilon; *dec_value is within *error_bound of svm_predict_values */
+double svm_ball_tree_predict_values(const struct svm_ball_tree *tree, const double *x, int n, double *dec_value,
+                                    double *error_bound);
+
+/* improved fast Gauss transform of an RBF one-class or regression model, the decision value is within
+   tolerance of svm_predict_values; NULL for other models or if no expansion reaches the tolerance
+   faster than exact summation */
+struct svm_fgt;
+struct svm_fgt *svm_build_fgt(const struct svm_model *model, double tolerance);
+void svm_free_fgt(struct svm_fgt **fgt_ptr_ptr);
+double svm_fgt_predict_values(const struct svm_fgt *fgt, const double *x, int n, double *dec_value,
+                              struct svm_workspace *ws);
 
 void svm_free_model_content(struct svm_model *model_ptr);
 void svm_free_and_destroy_model(struct svm_model **model_ptr_ptr);
@@ -97,6 +208,26 @@ int svm_check_probability_model(const struct svm_model *model);
 
 void svm_set_print_string_function(void (*print_func)(const char *));
 
+/* nr_thread if positive, else the number of cores */
+int svm_thread_num(int nr_thread);
+/* f(i, thread, arg) for i < n on up to svm_thread_num(nr_thread) threads, each taking the next i when it is
+   free; thread < nr_thread tells which one runs it */
+void svm_parallel_for(int n, int nr_thread, void (*f)(int i, int thread, void *arg), void *arg);
+
+/* base^times by repeated squaring as in the POLY kernel, inline so that other dense
+   predict paths evaluate the kernel exactly like svm_predict */
+static inline double svm_powi(double base, int times)
+{
+    double tmp = base, ret = 1.0;
+
+    for(int t=times; t>0; t/=2)
+    {
+        if(t%2==1) ret*=tmp;
+        tmp = tmp * tmp;
+    }
+    return ret;
+}
+
 #ifdef __cplusplus
 }
 #endif
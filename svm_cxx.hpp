@@ -3,7 +3,10 @@
 
 #include <string>
 #include <vector>
+#include <random>
 #include <iostream>
+#include <stdexcept>
+#include <utility>
 #include "libsvm/svm.h"
 #include "dataframe.hpp"
 
@@ -12,20 +15,41 @@
 class svm_cxx {
 private:
     struct svm_model *model;
+    struct svm_compiled_model *compiled;
+    struct svm_ball_tree *ball_tree;
+    double pruning_epsilon;
+    struct svm_fgt *fgt;
+    double fgt_tolerance;
+    struct svm_quantized_model *quantized;
+    int quantize_precision;
+    std::vector<struct svm_model *> path_models;
     struct svm_parameter param{};
     struct svm_problem prob{};
     struct svm_node *x_space;
-    struct svm_node *svm_node_data;
+    std::vector<double> train_dec_values;
+    std::vector<const double *> dense_column;
+    std::vector<double> dense_y;
+    struct svm_workspace *workspace;
+    std::string checkpoint_file;
+    int checkpoint_interval;
     int feature_num;
 public:
     explicit svm_cxx(int _feature_num, const std::string &filename = "") :
         model(nullptr),
+        compiled(nullptr),
+        ball_tree(nullptr),
+        pruning_epsilon(0),
+        fgt(nullptr),
+        fgt_tolerance(0),
+        quantized(nullptr),
+        quantize_precision(-1),
         x_space(nullptr),
+        workspace(nullptr),
+        checkpoint_interval(0),
         feature_num(_feature_num) {
         prob.l = 0;
         prob.x = nullptr;
         prob.y = nullptr;
-        svm_node_data = Malloc(struct svm_node,feature_num + 1);
         if(!filename.empty())
             load_model(filename);
     }
@@ -34,12 +58,32 @@ public:
         free_model();
         free_param();
         free_dataset();
-        free(svm_node_data);
+    }
+
+    // the model, its compiled forms and the training set are owned through raw pointers: a move hands
+    // them over and leaves the source without a model, copies are not allowed. Share a trained model
+    // between threads through a std::shared_ptr<const svm_cxx>
+    svm_cxx(const svm_cxx &) = delete;
+    svm_cxx &operator=(const svm_cxx &) = delete;
+
+    svm_cxx(svm_cxx &&other) noexcept : svm_cxx(other.feature_num) {
+        swap(other);
+    }
+
+    svm_cxx &operator=(svm_cxx &&other) noexcept {
+        if (this != &other) {
+            free_model();
+            free_param();
+            free_dataset();
+            swap(other);
+        }
+        return *this;
     }
 
     void param_init(int svm_type = C_SVC, int kernel_type = RBF, int degree = 3, double gamma = 0, double coef0 = 0,
                     double nu = 0.5, double C = 1, double eps = 1e-3, double cache_size = 200, double p = 0.1,
-                    int shrinking = 1, int probability = 0, const std::vector<std::pair<int, double>> &nr_weight = {}) {
+                    int shrinking = 1, int probability = 0, const std::vector<std::pair<int, double>> &nr_weight = {},
+                    int nr_thread = 0, int shared_cache = 0, int prefetch = 0) {
         param.svm_type = svm_type; //set type of SVM (default C_SVC)
         param.kernel_type = kernel_type; //set type of kernel function (default RBF)
         param.degree = degree; //set degree in kernel function (default 3)
@@ -52,6 +96,9 @@ public:
         param.p = p; //set the epsilon in loss function of epsilon-SVR (default 0.1)
         param.shrinking = shrinking; //whether to use the shrinking heuristics, 0 or 1 (default 1)
         param.probability = probability; //whether to train a SVC or SVR model for probability estimates, 0 or 1 (default 0)
+        param.nr_thread = nr_thread; //set the number of threads for training, 0 for all cores (default 0)
+        param.shared_cache = shared_cache; //whether all one-vs-one pairs share one kernel cache, 0 or 1 (default 0)
+        param.prefetch = prefetch; //whether a helper thread prefetches kernel columns, 0 or 1 (default 0)
         param.nr_weight = nr_weight.size();
         if (param.nr_weight > 0) {
             //set the parameter C of class i to weight*C, for C-SVC (default 1)
@@ -88,10 +135,10 @@ public:
         x_space = Malloc(struct svm_node, elements + len);
 
         int j = 0;
-        for (int l = 0; l < len; l++) {
+        for (unsigned long long int l = 0; l < len; l++) {
             prob.x[l] = &x_space[j];
-            for (int d = 0; d < dim; d++) {
-                x_space[j].index = d + 1;
+            for (unsigned long long int d = 0; d < dim; d++) {
+                x_space[j].index = int(d) + 1;
                 x_space[j].value = dataset(d)[l];
                 j++;
             }
@@ -103,12 +150,28 @@ public:
         }
     }
 
-    double train(const dataframe<double> &dataset, const std::vector<double> &label = {}, int nr_fold = 5) {
-        if(dataset.column_num() != feature_num)
+    // loo_error: if not null, receives the leave-one-out error estimate in percent (span estimate for
+    // one-class models, xi-alpha for classifiers; -1 if not available for this svm_type)
+    double train(const dataframe<double> &dataset, const std::vector<double> &label = {}, int nr_fold = 5,
+                 double *loo_error = nullptr) {
+        if(int(dataset.column_num()) != feature_num)
             return -1;
         free_model();
-        read_problem(dataset, label);
-        if(prob.l <= 0)
+        // one-class and regression models without cross validation train straight
+        // from the dataframe columns instead of a svm_node copy of the dataset
+        bool dense = nr_fold <= 1 && param.probability == 0 && param.kernel_type != PRECOMPUTED &&
+                     (param.svm_type == ONE_CLASS || param.svm_type == EPSILON_SVR || param.svm_type == NU_SVR);
+        int len;
+        if (dense) {
+            if (dataset.empty() || (label.size() < dataset.row_num() && param.svm_type != ONE_CLASS))
+                return -1;
+            free_dataset();
+            len = dataset.row_num();
+        } else {
+            read_problem(dataset, label);
+            len = prob.l;
+        }
+        if(len <= 0)
             return -1;
         if (param.gamma < 1e-6)
             param.gamma = 1.0 / double(dataset.column_num());
@@ -117,40 +180,529 @@ public:
             std::cout << error_log;
             return 0;
         }
-        model = svm_train(&prob, &param);
+        struct svm_train_info train_info{};
+        train_dec_values.assign(len, 0);
+        train_info.dec_values = train_dec_values.data();
+        train_info.workspace = workspace;
+        train_info.want_loo_error = loo_error != nullptr;
+        if (!checkpoint_file.empty()) {
+            train_info.checkpoint_file = checkpoint_file.c_str();
+            train_info.checkpoint_interval = checkpoint_interval;
+        }
+        if (dense) {
+            dense_column.resize(feature_num);
+            for (int d = 0; d < feature_num; d++)
+                dense_column[d] = dataset(d).get_std_vector().data();
+            if (param.svm_type == ONE_CLASS)
+                dense_y.assign(len, 1);
+            else dense_y.assign(label.begin(), label.begin() + len);
+            struct svm_dense_problem dense_prob{len, feature_num, dense_y.data(), dense_column.data()};
+            model = svm_train_dense(&dense_prob, &param, &train_info);
+        } else model = svm_train_ex(&prob, &param, &train_info);
+        if (!train_info.has_dec_values)
+            train_dec_values.clear();
+        if (loo_error != nullptr)
+            *loo_error = train_info.loo_error < 0 ? -1 : 100.0 * train_info.loo_error;
         double accaurcy;
         if(nr_fold > 1)
             accaurcy = cross_validation(nr_fold);
+        else if(!train_dec_values.empty() && !probability_output())
+            accaurcy = train_validation(label);
         else accaurcy = clf_validation(dataset, label);
+        compact_model(model);
+        compile_model();
+        free_dataset();
         return accaurcy;
     }
 
-    std::pair<double, double> predict(svm_node *_svm_node_data) {
-        double result;
-        double dec_value;
-        if (svm_check_probability_model(model)) {
-            auto prob_vector = Malloc(double, model->nr_class);
-            result = svm_predict_probability(model, _svm_node_data, prob_vector);
-            for (int k = 0; k < model->nr_class; k++) {
-                if (model->label[k] == result) {
-                    dec_value = prob_vector[k];
-                    break;
+    // one-class and regression training saves the solver state to file every interval iterations
+    // and a later train on the same data resumes from it (empty file: no checkpoints)
+    void set_checkpoint(const std::string &file, int interval = 100000) {
+        checkpoint_file = file;
+        checkpoint_interval = interval;
+    }
+
+    // threads a single training may use (0: all cores), see param_init
+    void set_nr_thread(int nr_thread) {
+        param.nr_thread = nr_thread;
+    }
+
+    // one-class training solves on ws (see svm_create_workspace) instead of allocating its own
+    // buffers; ws is not owned and must not be used by another thread at the same time
+    void set_workspace(struct svm_workspace *ws) {
+        workspace = ws;
+    }
+
+    // decision values of the rows of the last training set, taken from the solver
+    // (empty unless the model is one-class or a two-class classifier)
+    const std::vector<double> &get_train_dec_values() const {
+        return train_dec_values;
+    }
+
+    // accuracy on the last training set from get_train_dec_values, without any kernel evaluation
+    // (-1 for probability models, whose labels come from the probabilities: use clf_validation)
+    double train_validation(const std::vector<double> &label = {}) {
+        if (train_dec_values.empty() || model == nullptr || probability_output() ||
+            ((label.size() < train_dec_values.size()) && (model->param.svm_type != ONE_CLASS)))
+            return -1;
+        double total_correct = 0;
+        for (unsigned long long int i = 0; i < train_dec_values.size(); i++) {
+            if(model->param.svm_type == ONE_CLASS) {
+                if (train_dec_values[i] > 0)
+                    ++total_correct;
+            }else{
+                int result = train_dec_values[i] > 0 ? model->label[0] : model->label[1];
+                if (result == int(label[i]))
+                    ++total_correct;
+            }
+        }
+        return 100.0 * total_correct / double(train_dec_values.size());
+    }
+
+    // train one one-class model per nu, warm-starting each solve from the previous one;
+    // the first model becomes the current one, see select_path_model
+    int train_nu_path(const dataframe<double> &dataset, const std::vector<double> &nu_list) {
+        if(int(dataset.column_num()) != feature_num || nu_list.empty() || param.svm_type != ONE_CLASS)
+            return -1;
+        free_model();
+        read_problem(dataset, {});
+        if(prob.l <= 0)
+            return -1;
+        if (param.gamma < 1e-6)
+            param.gamma = 1.0 / double(dataset.column_num());
+        for (const auto &nu : nu_list) {
+            param.nu = nu;
+            auto error_log = svm_check_parameter(&prob, &param);
+            if (error_log != nullptr) {
+                std::cout << error_log;
+                return -1;
+            }
+        }
+        path_models.assign(nu_list.size(), nullptr);
+        if (svm_train_one_class_path(&prob, &param, int(nu_list.size()), nu_list.data(), path_models.data()) != 0) {
+            path_models.clear();
+            return -1;
+        }
+        for (auto &item : path_models)
+            compact_model(item);
+        model = path_models.front();
+        compile_model();
+        free_dataset();
+        return 0;
+    }
+
+    int select_path_model(unsigned long long int index) {
+        if (index >= path_models.size())
+            return -1;
+        model = path_models[index];
+        param.nu = model->param.nu;
+        compile_model();
+        return 0;
+    }
+
+    [[nodiscard]] unsigned long long int path_model_num() const {
+        return path_models.size();
+    }
+
+    // cascade training of a one-class model on all cores: every shard is trained in parallel,
+    // the support vectors of pairs of shards are merged and retrained until one model is left,
+    // and the rows that violate it are fed back until the support vector set is stable. Every
+    // solve keeps the alphas of the full problem (summing to nu times the rows it covers), so -1
+    // is returned when a set of rows is too small to carry them rather than solving another nu
+    double train_cascade(const dataframe<double> &dataset, int nr_shard = 0, int nr_thread = 0, int max_iter = 10) {
+        if(int(dataset.column_num()) != feature_num || param.svm_type != ONE_CLASS)
+            return -1;
+        free_model();
+        read_problem(dataset, {});
+        if(prob.l <= 0)
+            return -1;
+        if (param.gamma < 1e-6)
+            param.gamma = 1.0 / double(dataset.column_num());
+        auto error_log = svm_check_parameter(&prob, &param);
+        if (error_log != nullptr) {
+            std::cout << error_log;
+            return 0;
+        }
+        nr_thread = svm_thread_num(nr_thread);
+        if (nr_shard <= 0)
+            nr_shard = nr_thread;
+        nr_shard = std::min(nr_shard, prob.l);
+
+        struct svm_parameter sub_param = param;
+        sub_param.cache_size = param.cache_size / nr_thread;
+        sub_param.nr_thread = 1;
+
+        // a set of rows standing in for `covered` rows of the training set
+        struct cascade_set {
+            std::vector<int> rows;
+            int covered;
+        };
+        // replaces set.rows by the support vectors of its solve, false if the rows are too few
+        auto support_vectors = [&](cascade_set &set) {
+            struct svm_model *sub_model = train_rows(set.rows, param.nu * set.covered, sub_param);
+            if (sub_model == nullptr)
+                return false;
+            set.rows.resize(sub_model->l);
+            for (int i = 0; i < sub_model->l; ++i)
+                set.rows[i] = sub_model->sv_indices[i] - 1;
+            svm_free_and_destroy_model(&sub_model);
+            return true;
+        };
+
+        std::vector<cascade_set> level(nr_shard);
+        for (int i = 0; i < nr_shard; ++i) {
+            int begin = int((long long) i * prob.l / nr_shard);
+            int end = int((long long) (i + 1) * prob.l / nr_shard);
+            for (int j = begin; j < end; ++j)
+                level[i].rows.push_back(j);
+            level[i].covered = end - begin;
+        }
+        std::vector<char> solved(nr_shard, 1);
+        parallel_for(nr_shard, nr_thread, [&](int i) {
+            solved[i] = support_vectors(level[i]);
+        });
+        while (level.size() > 1 && std::find(solved.begin(), solved.end(), 0) == solved.end()) {
+            std::vector<cascade_set> next((level.size() + 1) / 2);
+            parallel_for(int(next.size()), nr_thread, [&](int i) {
+                next[i] = level[2 * i];
+                if (2 * i + 1 < int(level.size())) {
+                    const cascade_set &other = level[2 * i + 1];
+                    next[i].rows.insert(next[i].rows.end(), other.rows.begin(), other.rows.end());
+                    next[i].covered += other.covered;
+                    solved[i] = support_vectors(next[i]);
                 }
+            });
+            level = std::move(next);
+        }
+        if (std::find(solved.begin(), solved.end(), 0) != solved.end()) {
+            free_dataset();
+            return -1;
+        }
+
+        std::vector<int> rows = level.front().rows;
+        std::vector<double> dec_values(prob.l);
+        for (int iter = 0; iter < max_iter; ++iter) {
+            svm_free_and_destroy_model(&model);
+            std::sort(rows.begin(), rows.end());
+            model = train_rows(rows, param.nu * prob.l, param);
+            if (model == nullptr) {
+                free_dataset();
+                return -1;
             }
-            delete[] prob_vector;
-        } else {
-            result = svm_predict_values(model, _svm_node_data, &dec_value);
+            model->param.nu = param.nu;
+
+            int nr_block = nr_thread * 4;
+            parallel_for(nr_block, nr_thread, [&](int b) {
+                int begin = int((long long) b * prob.l / nr_block);
+                int end = int((long long) (b + 1) * prob.l / nr_block);
+                for (int i = begin; i < end; ++i)
+                    svm_predict_values(model, prob.x[i], &dec_values[i]);
+            });
+
+            // rows left out of the last solve must satisfy f(x) >= 0 to keep alpha = 0
+            std::vector<int> next_rows(model->l);
+            for (int i = 0; i < model->l; ++i)
+                next_rows[i] = model->sv_indices[i] - 1;
+            std::vector<bool> in_rows(prob.l, false);
+            for (const auto &row : rows)
+                in_rows[row] = true;
+            bool violated = false;
+            for (int i = 0; i < prob.l; ++i)
+                if (!in_rows[i] && dec_values[i] < 0) {
+                    next_rows.push_back(i);
+                    violated = true;
+                }
+            std::sort(next_rows.begin(), next_rows.end());
+            if (!violated || next_rows == rows)
+                break;
+            rows = std::move(next_rows);
         }
-        return {result, dec_value};
+
+        train_dec_values = std::move(dec_values);
+        compact_model(model);
+        compile_model();
+        free_dataset();
+        return train_validation();
     }
 
-    std::pair<double,double> predict(const std::vector<double> &data) {
-        for (int i = 0; i < data.size(); i++) {
-            svm_node_data[i].index = i + 1;
-            svm_node_data[i].value = data[i];
+    // the const predict() overloads only read the model and keep their buffers per calling thread
+    // (see thread_scratch), so any number of threads may score with one instance at the same time
+    std::pair<double, double> predict(const svm_node *_svm_node_data) const {
+        auto &scratch = thread_scratch();
+        scratch.reserve(model, feature_num);
+        return predict(_svm_node_data, scratch.dec.data(), scratch.prob.data(), scratch.ws);
+    }
+
+    std::pair<double,double> predict(const std::vector<double> &data) const {
+        double error_bound;
+        return predict(data, error_bound);
+    }
+
+    // error_bound: how far the decision value may be from the exact one, 0 unless pruning or the
+    // fast Gauss transform is on
+    std::pair<double,double> predict(const std::vector<double> &data, double &error_bound) const {
+        error_bound = 0;
+        auto &scratch = thread_scratch();
+        scratch.reserve(model, int(data.size()));
+        if (fgt != nullptr) {
+            double dec_value;
+            double result = svm_fgt_predict_values(fgt, data.data(), int(data.size()), &dec_value, scratch.ws);
+            error_bound = fgt_tolerance;
+            return {result, dec_value};
+        }
+        if (ball_tree != nullptr) {
+            double dec_value;
+            double result = svm_ball_tree_predict_values(ball_tree, data.data(), int(data.size()), &dec_value,
+                                                         &error_bound);
+            return {result, dec_value};
+        }
+        if (compiled != nullptr && probability_output()) {
+            double result = svm_compiled_predict_probability(compiled, data.data(), int(data.size()),
+                                                             scratch.prob.data(), scratch.ws);
+            return with_probability(result, scratch.prob.data());
+        }
+        if (quantized != nullptr) {
+            double result = svm_quantized_predict_values(quantized, data.data(), int(data.size()),
+                                                         scratch.dec.data(), scratch.ws);
+            return {result, scratch.dec[0]};
+        }
+        if (compiled != nullptr) {
+            double result = svm_compiled_predict_values(compiled, data.data(), int(data.size()),
+                                                        scratch.dec.data());
+            return {result, scratch.dec[0]};
         }
-        svm_node_data[data.size()].index = -1;
-        return std::move(predict(svm_node_data));
+        for (unsigned long long int i = 0; i < data.size(); i++) {
+            scratch.node[i].index = int(i) + 1;
+            scratch.node[i].value = data[i];
+        }
+        scratch.node[data.size()].index = -1;
+        return predict(scratch.node.data(), scratch.dec.data(), scratch.prob.data(), scratch.ws);
+    }
+
+    // RBF one-class and regression models: index the support vectors in a ball tree and let predict()
+    // skip the ones whose contribution |sv_coef| * K is provably at most epsilon; kept across
+    // train/load, epsilon <= 0 turns it off. Returns -1 if the current model cannot be indexed
+    int set_pruning(double epsilon) {
+        pruning_epsilon = std::max(epsilon, 0.0);
+        build_ball_tree();
+        return pruning_epsilon > 0 && ball_tree == nullptr ? -1 : 0;
+    }
+
+    // RBF one-class and regression models: let predict() sum the support vectors with the improved fast
+    // Gauss transform, in time independent of the number of support vectors, with decision values
+    // within tolerance of the exact ones; takes precedence over pruning, kept across train/load,
+    // tolerance <= 0 turns it off. Returns -1 if the current model cannot be expanded
+    int set_fast_gauss(double tolerance) {
+        fgt_tolerance = std::max(tolerance, 0.0);
+        build_fgt();
+        return fgt_tolerance > 0 && fgt == nullptr ? -1 : 0;
+    }
+
+    // error of a quantized model against the exact svm_predict_values on a calibration set
+    struct quantization_report {
+        long long int row_num;
+        double max_error;           // largest |decision value difference| over all rows and pairs
+        double rms_error;
+        double label_agreement;     // % of rows with the exact label, -1 for regression
+        long int sv_bytes;          // quantized SV matrix
+        long int exact_sv_bytes;    // compiled (double) SV matrix
+    };
+
+    // let predict() score with the support vectors stored as QUANT_INT8 (int8, a scale per feature) or
+    // QUANT_FP16, an eighth or a quarter of the memory of the compiled model. Kept across train/load,
+    // -1 turns it off. Returns -1 if the current model cannot be quantized (probability model or
+    // precomputed kernel)
+    int set_quantization(int precision) {
+        quantize_precision = precision;
+        build_quantized();
+        return quantize_precision >= 0 && quantized == nullptr ? -1 : 0;
+    }
+
+    // compare the quantized decision values on every row of dataset with svm_predict_values; printing
+    // the report is left to the caller
+    quantization_report calibrate_quantization(const dataframe<double> &dataset) const {
+        quantization_report report{0, 0, 0, 100, 0, 0};
+        if (quantized == nullptr || int(dataset.column_num()) != feature_num)
+            return report;
+        report.sv_bytes = svm_quantized_sv_bytes(quantized, &report.exact_sv_bytes);
+        auto &scratch = thread_scratch();
+        scratch.reserve(model, feature_num);
+        std::vector<double> exact(scratch.dec.size());
+        int nr_pair = std::max(1, model->nr_class * (model->nr_class - 1) / 2);
+        long long int agree = 0;
+        for (unsigned long long int i = 0; i < dataset.row_num(); ++i) {
+            for (int j = 0; j < feature_num; ++j) {
+                scratch.node[j].index = j + 1;
+                scratch.node[j].value = scratch.row[j] = dataset(j)[i];
+            }
+            scratch.node[feature_num].index = -1;
+            double label = svm_predict_values_ws(model, scratch.node.data(), exact.data(), scratch.ws);
+            double quantized_label = svm_quantized_predict_values(quantized, scratch.row.data(), feature_num,
+                                                                  scratch.dec.data(), scratch.ws);
+            for (int p = 0; p < nr_pair; ++p) {
+                double error = fabs(scratch.dec[p] - exact[p]);
+                report.max_error = std::max(report.max_error, error);
+                report.rms_error += error * error;
+            }
+            if (label == quantized_label)
+                ++agree;
+        }
+        report.row_num = (long long int) dataset.row_num();
+        if (report.row_num > 0) {
+            report.rms_error = sqrt(report.rms_error / double(report.row_num * nr_pair));
+            report.label_agreement = 100.0 * double(agree) / double(report.row_num);
+        }
+        if (model->param.svm_type == EPSILON_SVR || model->param.svm_type == NU_SVR)
+            report.label_agreement = -1;
+        return report;
+    }
+
+    // one-class and regression RBF models trained on rows scaled as (x - first) / second (see scaler):
+    // the model compiled to score the unscaled rows with svm_compiled_predict_values/label, giving the
+    // decision values of the compiled model on the scaled rows (no pruning, fast Gauss transform or
+    // quantization); nullptr for other models. The caller frees it with svm_free_compiled_model
+    struct svm_compiled_model *compile_scaled(const std::vector<std::pair<double, double>> &scaler_array) const {
+        if (model == nullptr || probability_output() || model->param.kernel_type != RBF ||
+            (model->param.svm_type != ONE_CLASS && model->param.svm_type != EPSILON_SVR &&
+             model->param.svm_type != NU_SVR))
+            return nullptr;
+        std::vector<double> shift, scale;
+        for (const auto &item : scaler_array) {
+            shift.push_back(item.first);
+            scale.push_back(item.second);
+        }
+        return svm_compile_scaled_model(model, shift.data(), scale.data(), int(scaler_array.size()));
+    }
+
+    // label of predict() without the decision value; one-class RBF models stop summing the support
+    // vectors, largest coefficient first, as soon as the sign is certain
+    double predict_label(const std::vector<double> &data) const {
+        if (compiled != nullptr && quantized == nullptr && !probability_output())
+            return svm_compiled_predict_label(compiled, data.data(), int(data.size()));
+        return predict(data).first;
+    }
+
+    // predict() of every row of dataset, scored in parallel over row ranges; each worker thread uses
+    // its own scratch buffers and the results keep the row order
+    std::vector<std::pair<double, double>> predict(const dataframe<double> &dataset) const {
+        std::vector<std::pair<double, double>> result;
+        if (model == nullptr || int(dataset.column_num()) != feature_num)
+            return result;
+        auto row_num = (long long int) dataset.row_num();
+        result.resize(row_num);
+        int nr_thread = thread_num();
+        int nr_block = int(std::min<long long int>(row_num, nr_thread * 4LL));
+        bool use_compiled = compiled != nullptr;
+        bool probability = probability_output();
+        parallel_for(nr_block, nr_thread, [&](int b) {
+            auto &scratch = thread_scratch();
+            scratch.reserve(model, feature_num);
+            auto &node = scratch.node;
+            auto &row = scratch.row;
+            auto &dec = scratch.dec;
+            node[feature_num].index = -1;
+            for (long long int i = b * row_num / nr_block; i < (b + 1) * row_num / nr_block; ++i) {
+                if (use_compiled) {
+                    for (int j = 0; j < feature_num; ++j)
+                        row[j] = dataset(j)[i];
+                    double label;
+                    if (probability) {
+                        label = svm_compiled_predict_probability(compiled, row.data(), feature_num,
+                                                                 scratch.prob.data(), scratch.ws);
+                        result[i] = with_probability(label, scratch.prob.data());
+                        continue;
+                    }
+                    if (fgt != nullptr)
+                        label = svm_fgt_predict_values(fgt, row.data(), feature_num, dec.data(), scratch.ws);
+                    else if (ball_tree != nullptr)
+                        label = svm_ball_tree_predict_values(ball_tree, row.data(), feature_num, dec.data(), nullptr);
+                    else if (quantized != nullptr)
+                        label = svm_quantized_predict_values(quantized, row.data(), feature_num, dec.data(), scratch.ws);
+                    else label = svm_compiled_predict_values(compiled, row.data(), feature_num, dec.data());
+                    result[i] = {label, dec[0]};
+                } else {
+                    for (int j = 0; j < feature_num; ++j) {
+                        node[j].index = j + 1;
+                        node[j].value = dataset(j)[i];
+                    }
+                    result[i] = predict(node.data(), dec.data(), scratch.prob.data(), scratch.ws);
+                }
+            }
+        });
+        return result;
+    }
+
+    // class probabilities of every row of dataset for classifiers trained with probability estimates,
+    // row-major with one column per class in the order of the model labels; label receives the most
+    // probable class of each row. Rows are scored in parallel in batches through the compiled model,
+    // the result is empty for other models
+    std::vector<double> predict_probability(const dataframe<double> &dataset, std::vector<double> &label) const {
+        std::vector<double> result;
+        label.clear();
+        if (model == nullptr || compiled == nullptr || !probability_output() || int(dataset.column_num()) != feature_num)
+            return result;
+        auto row_num = (long long int) dataset.row_num();
+        int nr_class = model->nr_class;
+        result.resize(row_num * nr_class);
+        label.resize(row_num);
+        int nr_thread = thread_num();
+        long long int nr_batch = (row_num + batch_row - 1) / batch_row;
+        int nr_block = int(std::min<long long int>(nr_batch, nr_thread * 4LL));
+        parallel_for(nr_block, nr_thread, [&](int b) {
+            auto &scratch = thread_scratch();
+            for (long long int batch = b * nr_batch / nr_block; batch < (b + 1) * nr_batch / nr_block; ++batch) {
+                long long int begin = batch * batch_row;
+                int nr_row = int(std::min<long long int>(batch_row, row_num - begin));
+                if (scratch.row.size() < (unsigned long long int) nr_row * feature_num)
+                    scratch.row.resize((unsigned long long int) nr_row * feature_num);
+                for (int r = 0; r < nr_row; ++r)
+                    for (int j = 0; j < feature_num; ++j)
+                        scratch.row[(long long int) r * feature_num + j] = dataset(j)[begin + r];
+                svm_compiled_predict_probability_batch(compiled, scratch.row.data(), nr_row, feature_num,
+                                                       &label[begin], &result[begin * nr_class], scratch.ws);
+            }
+        });
+        return result;
+    }
+
+    // {label, decision value} of every row of dataset, as predict(dataset) returns them. Rows are scored
+    // in parallel over row blocks by svm_compiled_predict_values_batch, which reads every tile of support
+    // vectors once per tile of rows instead of once per row; probability models give the label and its
+    // probability from svm_compiled_predict_probability_batch. With pruning, the fast Gauss transform,
+    // quantization or a precomputed kernel this is predict(dataset)
+    std::vector<std::pair<double, double>> predict_batch(const dataframe<double> &dataset) const {
+        if (model == nullptr || compiled == nullptr || fgt != nullptr || ball_tree != nullptr || quantized != nullptr ||
+            int(dataset.column_num()) != feature_num)
+            return predict(dataset);
+        std::vector<std::pair<double, double>> result;
+        auto row_num = (long long int) dataset.row_num();
+        result.resize(row_num);
+        bool probability = probability_output();
+        int nr_value = probability ? model->nr_class : std::max(1, model->nr_class * (model->nr_class - 1) / 2);
+        int nr_thread = thread_num();
+        long long int nr_batch = (row_num + batch_row - 1) / batch_row;
+        int nr_block = int(std::min<long long int>(nr_batch, nr_thread * 4LL));
+        parallel_for(nr_block, nr_thread, [&](int b) {
+            auto &scratch = thread_scratch();
+            std::vector<double> row((long long int) batch_row * feature_num), label(batch_row);
+            std::vector<double> value((long long int) batch_row * nr_value);
+            for (long long int batch = b * nr_batch / nr_block; batch < (b + 1) * nr_batch / nr_block; ++batch) {
+                long long int begin = batch * batch_row;
+                int nr_row = int(std::min<long long int>(batch_row, row_num - begin));
+                for (int r = 0; r < nr_row; ++r)
+                    for (int j = 0; j < feature_num; ++j)
+                        row[(long long int) r * feature_num + j] = dataset(j)[begin + r];
+                if (probability)
+                    svm_compiled_predict_probability_batch(compiled, row.data(), nr_row, feature_num, label.data(),
+                                                           value.data(), scratch.ws);
+                else svm_compiled_predict_values_batch(compiled, row.data(), nr_row, feature_num, label.data(),
+                                                       value.data());
+                for (int r = 0; r < nr_row; ++r)
+                    result[begin + r] = probability ? with_probability(label[r], &value[(long long int) r * nr_value])
+                                                    : std::make_pair(label[r], value[(long long int) r * nr_value]);
+            }
+        });
+        return result;
     }
 
     int load_model(const std::string &model_path) {
@@ -158,40 +710,223 @@ public:
         model = svm_load_model(model_path.c_str());
         if (model == nullptr)
             return -1;
+        compile_model();
         return 0;
     }
 
     int save_model(const std::string &model_path) {
+        if (model == nullptr)
+            return -1;
         return svm_save_model(model_path.data(), model);
     }
 
-    double clf_validation(const dataframe<double> &dataset, const std::vector<double> &label = {}){
+    // change of the decision values on a validation set made by compress
+    struct compression_report {
+        int sv_num;                 // of the compressed model, -1 if the model could not be compressed
+        long long int row_num;
+        double max_error;           // largest |decision value difference| over all rows
+        double rms_error;
+        double label_agreement;     // % of rows keeping their label, -1 for regression
+    };
+
+    // replace the current one-class or regression model by one with at most budget support vectors: the
+    // support vectors are clustered by k-means weighted with |sv_coef|, the coefficients of the centers
+    // are the least squares fit of the decision function in feature space and rho is re-fitted on the
+    // old support vectors. The report compares the decision values on validation before and after
+    compression_report compress(int budget, const dataframe<double> &validation) {
+        compression_report report{-1, 0, 0, 0, 100};
+        if (model == nullptr || compiled == nullptr || budget <= 0 || int(validation.column_num()) != feature_num ||
+            (model->param.svm_type != ONE_CLASS && model->param.svm_type != EPSILON_SVR &&
+             model->param.svm_type != NU_SVR))
+            return report;
+        auto before = decision_values_of(validation);
+        int l = model->l;
+        if (l > budget) {
+            std::vector<double> x((long long int) l * feature_num, 0);
+            std::vector<double> alpha(l), weight(l);
+            for (int i = 0; i < l; ++i) {
+                for (const struct svm_node *p = model->SV[i]; p->index != -1; ++p)
+                    if (p->index >= 1 && p->index <= feature_num)
+                        x[(long long int) i * feature_num + p->index - 1] = p->value;
+                alpha[i] = model->sv_coef[0][i];
+                weight[i] = fabs(alpha[i]);
+            }
+            auto sv = [&](int i) { return &x[(long long int) i * feature_num]; };
+            auto distance = [&](const double *a, const double *b) {
+                double sum = 0;
+                for (int d = 0; d < feature_num; ++d)
+                    sum += (a[d] - b[d]) * (a[d] - b[d]);
+                return sum;
+            };
+
+            // k-means++ seeding with probability weight * squared distance to the nearest center
+            std::mt19937 rng(0);
+            std::vector<double> center;
+            std::vector<double> nearest(l, HUGE_VAL), seed(weight);
+            int nr_center = 0;
+            while (nr_center < budget) {
+                double total = 0;
+                for (int i = 0; i < l; ++i)
+                    total += seed[i];
+                if (total <= 0)
+                    break;
+                int pick = std::discrete_distribution<int>(seed.begin(), seed.end())(rng);
+                center.insert(center.end(), sv(pick), sv(pick) + feature_num);
+                for (int i = 0; i < l; ++i) {
+                    nearest[i] = std::min(nearest[i], distance(sv(i), &center[(long long int) nr_center * feature_num]));
+                    seed[i] = weight[i] * nearest[i];
+                }
+                ++nr_center;
+            }
+            std::vector<int> assign(l, -1);
+            for (int iter = 0; iter < 20; ++iter) {
+                bool changed = false;
+                for (int i = 0; i < l; ++i) {
+                    int best = 0;
+                    double best_distance = HUGE_VAL;
+                    for (int c = 0; c < nr_center; ++c) {
+                        double value = distance(sv(i), &center[(long long int) c * feature_num]);
+                        if (value < best_distance) {
+                            best = c;
+                            best_distance = value;
+                        }
+                    }
+                    if (assign[i] != best) {
+                        assign[i] = best;
+                        changed = true;
+                    }
+                }
+                if (!changed)
+                    break;
+                std::vector<double> sum(center.size(), 0), weight_sum(nr_center, 0);
+                for (int i = 0; i < l; ++i) {
+                    for (int d = 0; d < feature_num; ++d)
+                        sum[(long long int) assign[i] * feature_num + d] += weight[i] * sv(i)[d];
+                    weight_sum[assign[i]] += weight[i];
+                }
+                for (int c = 0; c < nr_center; ++c)
+                    if (weight_sum[c] > 0)
+                        for (int d = 0; d < feature_num; ++d)
+                            center[(long long int) c * feature_num + d] =
+                                    sum[(long long int) c * feature_num + d] / weight_sum[c];
+            }
+
+            // K_zz beta = K_zx alpha
+            std::vector<double> kzz((long long int) nr_center * nr_center), beta(nr_center, 0);
+            for (int a = 0; a < nr_center; ++a) {
+                for (int b = 0; b < nr_center; ++b)
+                    kzz[(long long int) a * nr_center + b] =
+                            dense_kernel(&center[(long long int) a * feature_num], &center[(long long int) b * feature_num]);
+                for (int i = 0; i < l; ++i)
+                    beta[a] += alpha[i] * dense_kernel(&center[(long long int) a * feature_num], sv(i));
+            }
+            if (!cholesky_solve(kzz, beta, nr_center))
+                return report;
+
+            // rho minimizing the squared change of the decision values on the old support vectors
+            double shift = 0;
+            for (int i = 0; i < l; ++i) {
+                double value = 0;
+                for (int a = 0; a < nr_center; ++a)
+                    value += beta[a] * dense_kernel(&center[(long long int) a * feature_num], sv(i));
+                double dec_value;
+                svm_compiled_predict_values(compiled, sv(i), feature_num, &dec_value);
+                shift += value - dec_value;
+            }
+
+            struct svm_model *reduced = Malloc(struct svm_model, 1);
+            *reduced = *model;
+            reduced->l = nr_center;
+            reduced->SV = Malloc(struct svm_node *, nr_center);
+            struct svm_node *block = Malloc(struct svm_node, (long long int) nr_center * (feature_num + 1));
+            reduced->sv_coef = Malloc(double *, 1);
+            reduced->sv_coef[0] = Malloc(double, nr_center);
+            for (int a = 0; a < nr_center; ++a) {
+                reduced->SV[a] = &block[(long long int) a * (feature_num + 1)];
+                for (int d = 0; d < feature_num; ++d)
+                    reduced->SV[a][d] = {d + 1, center[(long long int) a * feature_num + d]};
+                reduced->SV[a][feature_num].index = -1;
+                reduced->sv_coef[0][a] = beta[a];
+            }
+            reduced->rho = Malloc(double, 1);
+            reduced->rho[0] = shift / l;
+            reduced->probA = nullptr;
+            if (model->probA != nullptr) {
+                reduced->probA = Malloc(double, 1);
+                reduced->probA[0] = model->probA[0];
+            }
+            reduced->probB = nullptr;
+            reduced->sv_indices = nullptr;
+            reduced->label = nullptr;
+            reduced->nSV = nullptr;
+            reduced->free_sv = 1;
+
+            auto path = std::find(path_models.begin(), path_models.end(), model);
+            if (path != path_models.end())
+                *path = reduced;
+            svm_free_and_destroy_model(&model);
+            model = reduced;
+            train_dec_values.clear();
+            compile_model();
+        }
+
+        auto after = decision_values_of(validation);
+        long long int agree = 0;
+        for (unsigned long long int i = 0; i < before.size(); ++i) {
+            double error = fabs(after[i] - before[i]);
+            report.max_error = std::max(report.max_error, error);
+            report.rms_error += error * error;
+            if ((after[i] > 0) == (before[i] > 0))
+                ++agree;
+        }
+        report.sv_num = model->l;
+        report.row_num = (long long int) before.size();
+        if (report.row_num > 0) {
+            report.rms_error = sqrt(report.rms_error / double(report.row_num));
+            report.label_agreement = 100.0 * double(agree) / double(report.row_num);
+        }
+        if (model->param.svm_type != ONE_CLASS)
+            report.label_agreement = -1;
+        return report;
+    }
+
+    // threads used for scoring: param.nr_thread, 0 for all cores
+    [[nodiscard]] int thread_num() const {
+        return svm_thread_num(param.nr_thread);
+    }
+
+    // number of support vectors of the current model (0 if there is none)
+    [[nodiscard]] int sv_num() const {
+        return model == nullptr ? 0 : model->l;
+    }
+
+    double clf_validation(const dataframe<double> &dataset, const std::vector<double> &label = {}) const {
         if(((label.size() < dataset.row_num()) && (model->param.svm_type != ONE_CLASS)) ||
-            dataset.column_num() != feature_num)
+            int(dataset.column_num()) != feature_num)
             return -1;
         double total_correct = 0;
-        svm_node_data[dataset.column_num()].index = -1;
-        for (int i = 0; i < dataset.row_num(); i++) {
-            for (int j = 0; j < dataset.column_num(); j++) {
-                svm_node_data[j].index = j + 1;
-                svm_node_data[j].value = dataset(j)[i];
-            }
+        auto result = predict(dataset);
+        for (unsigned long long int i = 0; i < dataset.row_num(); i++) {
             if(model->param.svm_type == ONE_CLASS) {
-                if (svm_predict(model, svm_node_data) == int(1))
+                if (result[i].first == int(1))
                     ++total_correct;
             }else{
-                if (svm_predict(model, svm_node_data) == int(label[i]))
+                if (result[i].first == int(label[i]))
                     ++total_correct;
             }
         }
         return 100.0 * total_correct / double(dataset.row_num());
     }
 
+    // cross validation on the training set held by read_problem; train() releases it once the
+    // model is compacted, so afterwards pass the dataset again through the overload below
     double cross_validation(int nr_fold = 5) {
         int i;
         int total_correct = 0;
         double total_error = 0;
         double sumv = 0, sumy = 0, sumvv = 0, sumyy = 0, sumvy = 0;
+        if (prob.l <= 0)
+            throw (std::logic_error("cross_validation: no training set, it is released by train()"));
         auto target = Malloc(double, prob.l);
         svm_cross_validation(&prob, &param, nr_fold, target);
         if (param.svm_type == EPSILON_SVR ||
@@ -221,8 +956,274 @@ public:
         return 100.0 * total_correct / prob.l;
     }
 
+    // cross validation of the current parameters on dataset, released again afterwards
+    double cross_validation(const dataframe<double> &dataset, const std::vector<double> &label = {},
+                            int nr_fold = 5) {
+        if (int(dataset.column_num()) != feature_num)
+            return -1;
+        read_problem(dataset, label);
+        if (prob.l <= 0)
+            return -1;
+        if (param.gamma < 1e-6)
+            param.gamma = 1.0 / double(dataset.column_num());
+        double accuracy = cross_validation(nr_fold);
+        free_dataset();
+        return accuracy;
+    }
+
 private:
+    // rows per batch call of predict_batch and predict_probability
+    static constexpr int batch_row = 256;
+
+    // buffers of the const predict() overloads, one set per thread, grown to the largest model and
+    // row the thread has scored; they are freed when the thread exits
+    struct predict_scratch {
+        std::vector<struct svm_node> node;
+        std::vector<double> row;
+        std::vector<double> dec;
+        std::vector<double> prob;
+        struct svm_workspace *ws;
+
+        predict_scratch() : ws(svm_create_workspace()) {}
+        ~predict_scratch() {
+            svm_destroy_workspace(ws);
+        }
+        predict_scratch(const predict_scratch &) = delete;
+        predict_scratch &operator=(const predict_scratch &) = delete;
+
+        void reserve(const struct svm_model *model, int dim) {
+            if (node.size() < (unsigned long long int) dim + 1) {
+                node.resize(dim + 1);
+                row.resize(dim);
+            }
+            if (model == nullptr)
+                return;
+            auto nr_pair = (unsigned long long int) std::max(1, model->nr_class * (model->nr_class - 1) / 2);
+            if (dec.size() < nr_pair)
+                dec.resize(nr_pair);
+            if (prob.size() < (unsigned long long int) model->nr_class)
+                prob.resize(model->nr_class);
+        }
+    };
+
+    static predict_scratch &thread_scratch() {
+        thread_local predict_scratch scratch;
+        return scratch;
+    }
+
+    // predict() of one svm_node row with caller-owned scratch: dec holds a decision value per classifier
+    // pair and prob one estimate per class, ws the libsvm buffers
+    std::pair<double, double> predict(const svm_node *x, double *dec, double *prob, struct svm_workspace *ws) const {
+        if (probability_output())
+            return with_probability(svm_predict_probability_ws(model, x, prob, ws), prob);
+        double result = svm_predict_values_ws(model, x, dec, ws);
+        return {result, dec[0]};
+    }
+
+    // predict() reports the probability of the predicted class instead of a decision value; regression
+    // models with probability information keep their decision values
+    [[nodiscard]] bool probability_output() const {
+        return svm_check_probability_model(model) &&
+               (model->param.svm_type == C_SVC || model->param.svm_type == NU_SVC);
+    }
+
+    std::pair<double, double> with_probability(double label, const double *prob) const {
+        for (int k = 0; k < model->nr_class; k++)
+            if (model->label[k] == label)
+                return {label, prob[k]};
+        return {label, 0};
+    }
+
+    // decision value of the compiled model for every row of dataset
+    std::vector<double> decision_values_of(const dataframe<double> &dataset) {
+        std::vector<double> result(dataset.row_num());
+        std::vector<double> row(feature_num);
+        for (unsigned long long int i = 0; i < dataset.row_num(); ++i) {
+            for (int d = 0; d < feature_num; ++d)
+                row[d] = dataset(d)[i];
+            svm_compiled_predict_values(compiled, row.data(), feature_num, &result[i]);
+        }
+        return result;
+    }
+
+    // kernel of the current model between two dense vectors of feature_num values
+    [[nodiscard]] double dense_kernel(const double *a, const double *b) const {
+        const struct svm_parameter &kernel = model->param;
+        double dot = 0, distance = 0;
+        for (int d = 0; d < feature_num; ++d) {
+            dot += a[d] * b[d];
+            distance += (a[d] - b[d]) * (a[d] - b[d]);
+        }
+        switch (kernel.kernel_type) {
+            case RBF:
+                return exp(-kernel.gamma * distance);
+            case POLY:
+                return svm_powi(kernel.gamma * dot + kernel.coef0, kernel.degree);
+            case SIGMOID:
+                return tanh(kernel.gamma * dot + kernel.coef0);
+            default:
+                return dot;
+        }
+    }
+
+    // solve a x = b in place of b for the symmetric positive semi-definite n x n matrix a, adding a
+    // growing ridge to the diagonal until the Cholesky factorization succeeds
+    static bool cholesky_solve(const std::vector<double> &a, std::vector<double> &b, int n) {
+        double scale = 0;
+        for (int i = 0; i < n; ++i)
+            scale = std::max(scale, fabs(a[(long long int) i * n + i]));
+        for (double ridge = 1e-10 * std::max(scale, 1.0); ridge < scale + 1; ridge *= 100) {
+            std::vector<double> lower(a);
+            bool positive = true;
+            for (int j = 0; j < n && positive; ++j) {
+                double *row_j = &lower[(long long int) j * n];
+                double diagonal = row_j[j] + ridge;
+                for (int k = 0; k < j; ++k)
+                    diagonal -= row_j[k] * row_j[k];
+                if (diagonal <= 0) {
+                    positive = false;
+                    break;
+                }
+                row_j[j] = sqrt(diagonal);
+                for (int i = j + 1; i < n; ++i) {
+                    double *row_i = &lower[(long long int) i * n];
+                    double value = row_i[j];
+                    for (int k = 0; k < j; ++k)
+                        value -= row_i[k] * row_j[k];
+                    row_i[j] = value / row_j[j];
+                }
+            }
+            if (!positive)
+                continue;
+            for (int i = 0; i < n; ++i) {
+                for (int k = 0; k < i; ++k)
+                    b[i] -= lower[(long long int) i * n + k] * b[k];
+                b[i] /= lower[(long long int) i * n + i];
+            }
+            for (int i = n - 1; i >= 0; --i) {
+                for (int k = i + 1; k < n; ++k)
+                    b[i] -= lower[(long long int) k * n + i] * b[k];
+                b[i] /= lower[(long long int) i * n + i];
+            }
+            return true;
+        }
+        return false;
+    }
+
+    // f(i) for every i < n through svm_parallel_for
+    template<typename F>
+    static void parallel_for(int n, int nr_thread, F &&f) {
+        typedef typename std::remove_reference<F>::type function;
+        svm_parallel_for(n, nr_thread, [](int i, int, void *arg) { (*static_cast<function *>(arg))(i); },
+                         (void *) &f);
+    }
+
+    // train on a subset of the rows of prob with the alphas summing to `total` (nu times the rows
+    // the subset stands in for); sv_indices of the result refer to prob. nullptr if the subset has
+    // fewer rows than total, since no alpha may exceed 1 and shrinking nu would change the problem
+    struct svm_model *train_rows(const std::vector<int> &rows, double total, struct svm_parameter sub_param) const {
+        if (rows.empty() || total > double(rows.size()))
+            return nullptr;
+        struct svm_problem sub_prob{};
+        std::vector<struct svm_node *> x(rows.size());
+        std::vector<double> y(rows.size(), 1);
+        for (unsigned long long int i = 0; i < rows.size(); ++i)
+            x[i] = prob.x[rows[i]];
+        sub_prob.l = int(rows.size());
+        sub_prob.x = x.data();
+        sub_prob.y = y.data();
+        sub_param.nu = total / double(rows.size());
+        struct svm_model *sub_model = svm_train(&sub_prob, &sub_param);
+        for (int i = 0; i < sub_model->l; ++i)
+            sub_model->sv_indices[i] = rows[sub_model->sv_indices[i] - 1] + 1;
+        return sub_model;
+    }
+
+    // copy the support vectors of m into one block owned by m, so that it no longer
+    // points into x_space and the training set can be released
+    static void compact_model(struct svm_model *m) {
+        if (m == nullptr || m->free_sv)
+            return;
+        long long int elements = 0;
+        for (int i = 0; i < m->l; ++i) {
+            for (const struct svm_node *p = m->SV[i]; p->index != -1; ++p)
+                ++elements;
+            ++elements;
+        }
+        if (m->l > 0) {
+            struct svm_node *block = Malloc(struct svm_node, elements);
+            long long int j = 0;
+            for (int i = 0; i < m->l; ++i) {
+                const struct svm_node *p = m->SV[i];
+                m->SV[i] = &block[j];
+                while (p->index != -1)
+                    block[j++] = *p++;
+                block[j++].index = -1;
+            }
+        }
+        m->free_sv = 1;
+    }
+
+    // dense copy of the current model used by predict; probability models still go through svm_node
+    void compile_model() {
+        svm_free_compiled_model(&compiled);
+        compiled = svm_compile_model(model);
+        build_ball_tree();
+        build_fgt();
+        build_quantized();
+    }
+
+    void build_ball_tree() {
+        svm_free_ball_tree(&ball_tree);
+        if (pruning_epsilon > 0)
+            ball_tree = svm_build_ball_tree(model, pruning_epsilon);
+    }
+
+    void build_quantized() {
+        svm_free_quantized_model(&quantized);
+        if (quantize_precision >= 0 && !probability_output())
+            quantized = svm_quantize_model(model, quantize_precision);
+    }
+
+    void build_fgt() {
+        svm_free_fgt(&fgt);
+        if (fgt_tolerance > 0)
+            fgt = svm_build_fgt(model, fgt_tolerance);
+    }
+
+    void swap(svm_cxx &other) noexcept {
+        std::swap(model, other.model);
+        std::swap(compiled, other.compiled);
+        std::swap(ball_tree, other.ball_tree);
+        std::swap(pruning_epsilon, other.pruning_epsilon);
+        std::swap(fgt, other.fgt);
+        std::swap(fgt_tolerance, other.fgt_tolerance);
+        std::swap(quantized, other.quantized);
+        std::swap(quantize_precision, other.quantize_precision);
+        path_models.swap(other.path_models);
+        std::swap(param, other.param);
+        std::swap(prob, other.prob);
+        std::swap(x_space, other.x_space);
+        train_dec_values.swap(other.train_dec_values);
+        dense_column.swap(other.dense_column);
+        dense_y.swap(other.dense_y);
+        std::swap(workspace, other.workspace);
+        checkpoint_file.swap(other.checkpoint_file);
+        std::swap(checkpoint_interval, other.checkpoint_interval);
+        std::swap(feature_num, other.feature_num);
+    }
+
     void free_model() {
+        svm_free_compiled_model(&compiled);
+        svm_free_ball_tree(&ball_tree);
+        svm_free_fgt(&fgt);
+        svm_free_quantized_model(&quantized);
+        train_dec_values.clear();
+        if (std::find(path_models.begin(), path_models.end(), model) != path_models.end())
+            model = nullptr;
+        for (auto &item : path_models)
+            svm_free_and_destroy_model(&item);
+        path_models.clear();
         svm_free_and_destroy_model(&model);
     }
 
@@ -237,8 +1238,9 @@ private:
         return false;
     }
 
+    // the training set is kept only while the current model still points into it
     bool free_dataset() {
-        if (prob.l != 0 && model == nullptr) {
+        if (prob.l != 0 && (model == nullptr || model->free_sv)) {
             prob.l = 0;
             if(prob.y != nullptr) {
                 free(prob.y);
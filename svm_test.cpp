@@ -0,0 +1,916 @@
+#include <cmath>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <random>
+#include <thread>
+#include <vector>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "bulk_trainer.hpp"
+#include "detection.hpp"
+
+static int nr_failure = 0;
+
+#define CHECK(cond)                                                              \
+    do {                                                                         \
+        if (!(cond)) {                                                           \
+            std::printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+            ++nr_failure;                                                        \
+        }                                                                        \
+    } while (0)
+
+static void print_null(const char *) {}
+
+// fixed gaussian data as svm_node rows and as a dataframe; with classes, row i has label i % nr_class
+// (-1/+1 for two) and is shifted by it
+struct node_set {
+    std::vector<std::vector<svm_node>> rows;
+    std::vector<svm_node *> x;
+    std::vector<double> y;
+    dataframe<double> frame;
+
+    node_set(int l, int dim, unsigned seed, int nr_class = 1) : rows(l), x(l), y(l, 1), frame(dim) {
+        std::mt19937 gen(seed);
+        std::normal_distribution<double> normal_dist{0, 1};
+        for (int i = 0; i < l; ++i) {
+            if (nr_class == 2)
+                y[i] = i % 2 ? 1 : -1;
+            else if (nr_class > 2)
+                y[i] = i % nr_class;
+            rows[i].resize(dim + 1);
+            for (int j = 0; j < dim; ++j) {
+                rows[i][j].index = j + 1;
+                rows[i][j].value = normal_dist(gen) + (nr_class > 1 ? y[i] : 0);
+            }
+            rows[i][dim].index = -1;
+            x[i] = rows[i].data();
+            std::vector<double> row(dim);
+            for (int j = 0; j < dim; ++j)
+                row[j] = rows[i][j].value;
+            frame.append(std::move(row));
+        }
+    }
+
+    // regression targets instead of labels
+    void set_regression() {
+        for (unsigned long long int i = 0; i < y.size(); ++i)
+            y[i] = std::sin(rows[i][0].value) + 0.5 * rows[i][1].value;
+    }
+
+    // the features of row i as a dense row
+    std::vector<double> dense(int i) const {
+        std::vector<double> row;
+        for (const svm_node *p = x[i]; p->index != -1; ++p)
+            row.push_back(p->value);
+        return row;
+    }
+
+    svm_problem problem() { return svm_problem{int(x.size()), y.data(), x.data()}; }
+};
+
+static svm_parameter rbf_param(int svm_type) {
+    svm_parameter param{};
+    param.svm_type = svm_type;
+    param.kernel_type = RBF;
+    param.gamma = 0.5;
+    param.nu = 0.1;
+    param.C = 1;
+    param.cache_size = 10;
+    param.eps = 1e-6;
+    param.shrinking = 1;
+    return param;
+}
+
+// the span estimate must match the leave-one-out error of one-class models, the xi-alpha estimate
+// of classifiers must bound it from above
+static void test_loo_estimate(int svm_type, double nu) {
+    node_set data(80, 2, 7, svm_type == ONE_CLASS ? 1 : 2);
+    svm_parameter param = rbf_param(svm_type);
+    param.nu = nu;
+    svm_problem prob = data.problem();
+    std::vector<double> dec_values(prob.l);
+    svm_train_info train_info{};
+    train_info.dec_values = dec_values.data();
+    train_info.want_loo_error = 1;
+    svm_model *model = svm_train_ex(&prob, &param, &train_info);
+
+    int nr_error = 0;
+    for (int i = 0; i < prob.l; ++i) {
+        std::vector<svm_node *> x;
+        std::vector<double> y;
+        for (int j = 0; j < prob.l; ++j)
+            if (j != i) {
+                x.push_back(prob.x[j]);
+                y.push_back(prob.y[j]);
+            }
+        svm_problem loo_prob{prob.l - 1, y.data(), x.data()};
+        svm_model *loo_model = svm_train(&loo_prob, &param);
+        if (svm_predict(loo_model, prob.x[i]) != prob.y[i])
+            ++nr_error;
+        svm_free_and_destroy_model(&loo_model);
+    }
+    double loo_error = double(nr_error) / prob.l;
+    if (svm_type == ONE_CLASS) {
+        // one point of slack for left-out decision values within the solver tolerance of zero
+        CHECK(fabs(train_info.loo_error - loo_error) <= 1.0 / prob.l);
+        // svm_cxx trains one-class models from the dataframe columns
+        svm_cxx svm(2);
+        svm.param_init(ONE_CLASS, RBF, 3, param.gamma, 0, nu, 1, param.eps, param.cache_size);
+        double cxx_loo_error;
+        svm.train(data.frame, {}, 1, &cxx_loo_error);
+        CHECK(fabs(cxx_loo_error - 100 * train_info.loo_error) <= 1e-9);
+    } else {
+        CHECK(train_info.loo_error >= loo_error);
+        CHECK(train_info.loo_error <= double(model->l) / prob.l);
+    }
+
+    train_info.want_loo_error = 0;
+    svm_model *unwanted = svm_train_ex(&prob, &param, &train_info);
+    CHECK(train_info.loo_error == -1);
+    svm_free_and_destroy_model(&unwanted);
+    svm_free_and_destroy_model(&model);
+}
+
+// probability models label by probability, so the training accuracy must not come from the signs
+// of the training decision values
+static void test_train_validation_probability() {
+    node_set data(120, 2, 11, 2);
+    svm_cxx clf(2);
+    clf.param_init(C_SVC, RBF, 3, 0.5, 0, 0.5, 1, 1e-3, 10, 0.1, 1, 1);
+    double accuracy = clf.train(data.frame, data.y, 1);
+    CHECK(clf.train_validation(data.y) == -1);
+    CHECK(accuracy == clf.clf_validation(data.frame, data.y));
+}
+
+// train() releases its training set: cross_validation() must say so instead of returning -1
+static void test_cross_validation_after_train() {
+    node_set data(100, 2, 13);
+    svm_cxx one_class_svm(2);
+    one_class_svm.param_init(ONE_CLASS, RBF, 3, 0.5, 0, 0.1);
+    one_class_svm.train(data.frame, {}, 1);
+    bool thrown = false;
+    try {
+        one_class_svm.cross_validation(5);
+    } catch (const std::logic_error &) {
+        thrown = true;
+    }
+    CHECK(thrown);
+    double accuracy = one_class_svm.cross_validation(data.frame, {}, 5);
+    CHECK(accuracy > 50 && accuracy <= 100);
+}
+
+// a checkpoint left by the solve of other data must be ignored, not resumed
+static const char *checkpoint_file = "svm_test.checkpoint";
+static const char *stale_checkpoint_file = "svm_test.checkpoint.stale";
+
+static bool copy_file(const char *from, const char *to) {
+    FILE *in = std::fopen(from, "rb");
+    if (in == nullptr)
+        return false;
+    FILE *out = std::fopen(to, "wb");
+    char buffer[4096];
+    size_t n;
+    while ((n = std::fread(buffer, 1, sizeof(buffer), in)) > 0)
+        std::fwrite(buffer, 1, n, out);
+    std::fclose(in);
+    return std::fclose(out) == 0;
+}
+
+// the solver prints while it runs, so the checkpoint of an unfinished solve can be kept from here
+static void keep_checkpoint(const char *) {
+    copy_file(checkpoint_file, stale_checkpoint_file);
+}
+
+static void test_checkpoint_of_other_data() {
+    node_set data(100, 2, 17), other(100, 2, 19);
+    svm_parameter param = rbf_param(ONE_CLASS);
+    param.nu = 0.5;
+    svm_problem prob = data.problem(), other_prob = other.problem();
+    svm_train_info train_info{};
+    train_info.checkpoint_file = checkpoint_file;
+    train_info.checkpoint_interval = 1;
+
+    std::remove(stale_checkpoint_file);
+    svm_set_print_string_function(keep_checkpoint);
+    svm_model *model = svm_train_ex(&prob, &param, &train_info);
+    svm_set_print_string_function(print_null);
+    CHECK(copy_file(stale_checkpoint_file, checkpoint_file));
+
+    svm_model *fresh = svm_train(&other_prob, &param);
+    svm_model *resumed = svm_train_ex(&other_prob, &param, &train_info);
+    CHECK(resumed->rho[0] == fresh->rho[0]);
+    CHECK(resumed->l == fresh->l);
+
+    param.gamma = 2;
+    CHECK(copy_file(stale_checkpoint_file, checkpoint_file));
+    svm_model *fresh_gamma = svm_train(&prob, &param);
+    svm_model *resumed_gamma = svm_train_ex(&prob, &param, &train_info);
+    CHECK(resumed_gamma->rho[0] == fresh_gamma->rho[0]);
+
+    std::remove(stale_checkpoint_file);
+    svm_free_and_destroy_model(&resumed_gamma);
+    svm_free_and_destroy_model(&fresh_gamma);
+    svm_free_and_destroy_model(&resumed);
+    svm_free_and_destroy_model(&fresh);
+    svm_free_and_destroy_model(&model);
+}
+
+// a training process killed mid-solve leaves its last checkpoint, and the solve resumed from it
+// must end with the alphas and rho of an uninterrupted run
+static bool resumed = false;
+
+static void kill_training(const char *) {
+    std::raise(SIGKILL);
+}
+
+static void note_resume(const char *message) {
+    if (std::strncmp(message, "resuming", 8) == 0)
+        resumed = true;
+}
+
+static void test_checkpoint_resume_after_kill() {
+    node_set data(300, 2, 29);
+    svm_parameter param = rbf_param(ONE_CLASS);
+    param.nu = 0.5;
+    svm_problem prob = data.problem();
+    svm_train_info train_info{};
+    train_info.checkpoint_file = checkpoint_file;
+    train_info.checkpoint_interval = 7;
+
+    std::remove(checkpoint_file);
+    std::fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        // the solver prints its first progress mark after a few hundred iterations
+        svm_set_print_string_function(kill_training);
+        svm_train_ex(&prob, &param, &train_info);
+        _exit(0);
+    }
+    int status = 0;
+    waitpid(child, &status, 0);
+    CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGKILL);
+    FILE *left = std::fopen(checkpoint_file, "rb");
+    CHECK(left != nullptr);
+    if (left != nullptr)
+        std::fclose(left);
+
+    svm_model *uninterrupted = svm_train(&prob, &param);
+    resumed = false;
+    svm_set_print_string_function(note_resume);
+    svm_model *model = svm_train_ex(&prob, &param, &train_info);
+    svm_set_print_string_function(print_null);
+    CHECK(resumed);
+    CHECK(model->rho[0] == uninterrupted->rho[0]);
+    CHECK(model->l == uninterrupted->l);
+    for (int i = 0; i < model->l && model->l == uninterrupted->l; ++i) {
+        CHECK(model->sv_indices[i] == uninterrupted->sv_indices[i]);
+        CHECK(model->sv_coef[0][i] == uninterrupted->sv_coef[0][i]);
+    }
+    left = std::fopen(checkpoint_file, "rb");
+    CHECK(left == nullptr);
+    if (left != nullptr)
+        std::fclose(left);
+    svm_free_and_destroy_model(&model);
+    svm_free_and_destroy_model(&uninterrupted);
+}
+
+// a file at the checkpoint path that the solve neither wrote nor resumed from must survive it
+static void test_foreign_checkpoint_file_kept() {
+    node_set data(60, 2, 31);
+    svm_parameter param = rbf_param(ONE_CLASS);
+    svm_problem prob = data.problem();
+    svm_train_info train_info{};
+    train_info.checkpoint_file = checkpoint_file;
+    train_info.checkpoint_interval = 1000000;
+
+    FILE *fp = std::fopen(checkpoint_file, "wb");
+    std::fputs("not a checkpoint", fp);
+    std::fclose(fp);
+    svm_model *model = svm_train_ex(&prob, &param, &train_info);
+    fp = std::fopen(checkpoint_file, "rb");
+    CHECK(fp != nullptr);
+    if (fp != nullptr)
+        std::fclose(fp);
+    std::remove(checkpoint_file);
+    svm_free_and_destroy_model(&model);
+}
+
+// the prefetching helper thread only fills the cache early, so it must not change the model
+static void test_prefetch() {
+    for (int svm_type : {C_SVC, ONE_CLASS}) {
+        node_set data(1200, 4, 59, svm_type == C_SVC ? 2 : 1);
+        svm_parameter param = rbf_param(svm_type);
+        param.cache_size = 1;	// far below the 1200 x 1200 kernel, so columns keep missing
+        param.nr_thread = 2;
+        svm_problem prob = data.problem();
+        svm_model *plain = svm_train(&prob, &param);
+        param.prefetch = 1;
+        CHECK(svm_check_parameter(&prob, &param) == nullptr);
+        svm_model *model = svm_train(&prob, &param);
+        CHECK(model->l == plain->l);
+        CHECK(model->rho[0] == plain->rho[0]);
+        for (int i = 0; i < model->l && model->l == plain->l; ++i)
+            CHECK(model->sv_coef[0][i] == plain->sv_coef[0][i]);
+        svm_free_and_destroy_model(&model);
+        svm_free_and_destroy_model(&plain);
+    }
+}
+
+// entities trained by the work-stealing scheduler must give the models a lone svm_cxx gives; one
+// huge entity among many small ones makes the other threads steal its queue
+static void test_bulk_trainer() {
+    std::vector<dataframe<double>> datasets;
+    for (int e = 0; e < 12; ++e)
+        datasets.push_back(node_set(e == 0 ? 800 : 20 + 5 * e, 2, 23 + e).frame);
+    bulk_trainer trainer(3);
+    CHECK(trainer.train(datasets) == 0);
+    CHECK(trainer.model_num() == datasets.size());
+    for (unsigned long long int e = 0; e < datasets.size(); ++e) {
+        svm_cxx alone(2);
+        alone.one_class_svm_param_init();
+        double accuracy = alone.train(datasets[e], {}, 1);
+        CHECK(trainer.get_accuracy(e) == accuracy);
+        CHECK(trainer.get_model(e).sv_num() == alone.sv_num());
+    }
+}
+
+// the fused scaled model on raw rows with a feature far from zero against the unfused path:
+// svm_predict_values and the compiled model on the scaled rows
+static void test_scaled_model_large_offset() {
+    node_set data(200, 2, 29);
+    svm_parameter param = rbf_param(ONE_CLASS);
+    svm_problem prob = data.problem();
+    svm_model *model = svm_train(&prob, &param);
+    svm_compiled_model *compiled = svm_compile_model(model);
+
+    double shift[2] = {1e7 + 0.25, -3}, scale[2] = {1, 0.5};
+    svm_compiled_model *fused = svm_compile_scaled_model(model, shift, scale, 2);
+    CHECK(fused != nullptr);
+    double max_error = 0;
+    int nr_disagree = 0;
+    for (int i = 0; i < prob.l; ++i)
+        for (double offset : {0.0, 0.5, 2.0}) {
+            double z[2] = {prob.x[i][0].value + offset, prob.x[i][1].value - offset};
+            double x[2] = {z[0] * scale[0] + shift[0], z[1] * scale[1] + shift[1]};
+            // the scaled row as the scaler computes it from the raw one
+            svm_node node[3] = {{1, (x[0] - shift[0]) / scale[0]}, {2, (x[1] - shift[1]) / scale[1]}, {-1, 0}};
+            double scaled_row[2] = {node[0].value, node[1].value};
+            double expected, exact, dec_value;
+            double label = svm_predict_values(model, node, &expected);
+            svm_compiled_predict_values(compiled, scaled_row, 2, &exact);
+            CHECK(svm_compiled_predict_values(fused, x, 2, &dec_value) == label || fabs(expected) < 1e-12);
+            CHECK(dec_value == exact);
+            CHECK(svm_compiled_predict_label(fused, x, 2) == label || fabs(expected) < 1e-12);
+            max_error = std::max(max_error, fabs(dec_value - expected));
+            nr_disagree += (dec_value > 0) != (expected > 0);
+        }
+    CHECK(max_error < 1e-12);
+    CHECK(nr_disagree == 0);
+    svm_free_compiled_model(&fused);
+    svm_free_compiled_model(&compiled);
+    svm_free_and_destroy_model(&model);
+}
+
+static double kernel_value(const svm_parameter &param, const svm_node *x, const svm_node *y) {
+    double dot = 0, distance = 0;
+    for (; x->index != -1 && y->index != -1; ++x, ++y) {
+        dot += x->value * y->value;
+        distance += (x->value - y->value) * (x->value - y->value);
+    }
+    switch (param.kernel_type) {
+        case POLY:
+            return std::pow(param.gamma * dot + param.coef0, param.degree);
+        case RBF:
+            return std::exp(-param.gamma * distance);
+        case SIGMOID:
+            return std::tanh(param.gamma * dot + param.coef0);
+        default:
+            return dot;
+    }
+}
+
+// rounding bound of a decision value at x: the fast paths sum the same terms in another order, so
+// they agree up to a few ulps of the largest partial sum, not of the (possibly cancelled) result
+static double rounding_tolerance(const svm_model *model, const svm_node *x) {
+    double scale = 1;
+    for (int i = 0; i < model->l; ++i) {
+        double coef = 0;
+        for (int c = 0; c < std::max(1, model->nr_class - 1); ++c)
+            coef = std::max(coef, std::fabs(model->sv_coef[c][i]));
+        scale += coef * std::fabs(kernel_value(model->param, x, model->SV[i]));
+    }
+    for (int p = 0; p < std::max(1, model->nr_class * (model->nr_class - 1) / 2); ++p)
+        scale += std::fabs(model->rho[p]);
+    return 1e-13 * scale;
+}
+
+// decision values of svm_predict_values for every row of data
+static std::vector<std::vector<double>> exact_decision_values(const svm_model *model, const node_set &data,
+                                                              std::vector<double> &label) {
+    int nr_pair = std::max(1, model->nr_class * (model->nr_class - 1) / 2);
+    std::vector<std::vector<double>> dec(data.x.size(), std::vector<double>(nr_pair));
+    label.resize(data.x.size());
+    for (unsigned long long int i = 0; i < data.x.size(); ++i)
+        label[i] = svm_predict_values(model, data.x[i], dec[i].data());
+    return dec;
+}
+
+static bool near_tie(const std::vector<double> &dec, double tolerance) {
+    for (const auto &item : dec)
+        if (fabs(item) <= tolerance)
+            return true;
+    return false;
+}
+
+// the compiled model and its early-exit label against svm_predict_values, equal up to rounding for
+// every model type and kernel
+static void test_compiled_model() {
+    struct model_case {
+        int svm_type, kernel_type, nr_class;
+    } cases[] = {{ONE_CLASS, RBF, 1}, {ONE_CLASS, POLY, 1}, {ONE_CLASS, LINEAR, 1}, {ONE_CLASS, SIGMOID, 1},
+                 {EPSILON_SVR, RBF, 1}, {NU_SVR, POLY, 1}, {C_SVC, RBF, 2}, {C_SVC, RBF, 3}, {NU_SVC, POLY, 4}};
+    for (const auto &item : cases) {
+        node_set data(150, 3, 31, item.nr_class);
+        if (item.svm_type == EPSILON_SVR || item.svm_type == NU_SVR)
+            data.set_regression();
+        svm_parameter param = rbf_param(item.svm_type);
+        param.kernel_type = item.kernel_type;
+        param.degree = 3;
+        param.coef0 = 1;
+        param.gamma = item.kernel_type == SIGMOID ? 0.05 : param.gamma;
+        param.nu = item.svm_type == NU_SVC ? 0.2 : param.nu;
+        svm_problem prob = data.problem();
+        svm_model *model = svm_train(&prob, &param);
+        svm_compiled_model *compiled = svm_compile_model(model);
+        CHECK(compiled != nullptr);
+
+        std::vector<double> label;
+        auto exact = exact_decision_values(model, data, label);
+        std::vector<double> dec(exact[0].size());
+        for (int i = 0; i < prob.l; ++i) {
+            auto row = data.dense(i);
+            double compiled_label = svm_compiled_predict_values(compiled, row.data(), 3, dec.data());
+            double tolerance = rounding_tolerance(model, data.x[i]);
+            for (unsigned long long int p = 0; p < dec.size(); ++p)
+                CHECK(fabs(dec[p] - exact[i][p]) <= tolerance);
+            if (item.svm_type == EPSILON_SVR || item.svm_type == NU_SVR) {
+                CHECK(compiled_label == dec[0]);
+                CHECK(fabs(svm_compiled_predict_label(compiled, row.data(), 3) - label[i]) <= tolerance);
+            } else if (!near_tie(exact[i], tolerance)) {
+                CHECK(compiled_label == label[i]);
+                CHECK(svm_compiled_predict_label(compiled, row.data(), 3) == label[i]);
+            }
+        }
+        svm_free_compiled_model(&compiled);
+        svm_free_and_destroy_model(&model);
+    }
+}
+
+// predict_batch and the parallel predict(dataframe) of svm_cxx against its svm_node path
+static void test_batch_prediction() {
+    for (int kernel_type : {RBF, POLY, SIGMOID}) {
+        for (int nr_class : {1, 3}) {
+            node_set data(300, 4, 37, nr_class);
+            svm_parameter param = rbf_param(nr_class == 1 ? ONE_CLASS : C_SVC);
+            param.kernel_type = kernel_type;
+            param.degree = 3;
+            param.gamma = kernel_type == SIGMOID ? 0.05 : 0.5;
+            param.coef0 = 1;
+            svm_cxx svm(4);
+            svm.param_init(param.svm_type, kernel_type, param.degree, param.gamma, param.coef0, param.nu, param.C,
+                           param.eps, param.cache_size);
+            svm.set_nr_thread(2);
+            svm.train(data.frame, data.y, 1);
+            // the libsvm twin of the svm_cxx model bounds the rounding of its decision values
+            svm_problem prob = data.problem();
+            svm_model *twin = svm_train(&prob, &param);
+
+            auto batch = svm.predict_batch(data.frame);
+            auto parallel = svm.predict(data.frame);
+            CHECK(batch.size() == data.x.size() && parallel.size() == data.x.size());
+            for (unsigned long long int i = 0; i < batch.size() && i < parallel.size(); ++i) {
+                auto exact = svm.predict(data.x[i]);
+                double tolerance = rounding_tolerance(twin, data.x[i]);
+                CHECK(fabs(batch[i].second - exact.second) <= tolerance);
+                CHECK(fabs(parallel[i].second - exact.second) <= tolerance);
+                CHECK(batch[i].first == parallel[i].first);
+                if (fabs(exact.second) > tolerance)
+                    CHECK(parallel[i].first == exact.first);
+            }
+            svm_free_and_destroy_model(&twin);
+        }
+    }
+
+    // probability models: the label and probability of predict(), not the label of the decision values
+    node_set data(300, 4, 43, 3);
+    svm_cxx svm(4);
+    svm.param_init(C_SVC, RBF, 3, 0.5, 0, 0.5, 1, 1e-3, 10, 0.1, 1, 1);
+    svm.set_nr_thread(2);
+    svm.train(data.frame, data.y, 1);
+    auto batch = svm.predict_batch(data.frame);
+    CHECK(batch.size() == data.x.size());
+    for (unsigned long long int i = 0; i < batch.size(); ++i) {
+        auto exact = svm.predict(data.x[i]);
+        CHECK(batch[i].first == exact.first);
+        CHECK(fabs(batch[i].second - exact.second) <= 1e-9);
+    }
+}
+
+// detection::validation writes every row with the result and decision value predict() gives it,
+// scaled or not, and leaves the rows themselves unscaled
+static void test_detection_validation() {
+    node_set data(300, 2, 79);
+    dataframe<double> raw(std::vector<std::string>{"a", "b"});
+    for (unsigned long long int i = 0; i < data.x.size(); ++i)
+        raw.append({data.x[i][0].value * 3 + 100, data.x[i][1].value - 7});
+    standard_scaler<double> scaler(raw);
+    const char *scaler_file = "svm_test.scaler", *model_file = "svm_test.model", *output_file = "svm_test.csv";
+    scaler.save_scaler(scaler_file);
+    // the scaler as it is read back, which is what detection uses
+    standard_scaler<double> loaded(scaler_file);
+    svm_cxx one_class_svm(2);
+    one_class_svm.param_init(ONE_CLASS, RBF, 3, 0.5, 0, 0.1, 1, 1e-3, 10);
+    one_class_svm.train(loaded.transform_copy(raw), {}, 1);
+    CHECK(one_class_svm.save_model(model_file) == 0);
+
+    detection<double, standard_scaler> detector(2, model_file, scaler_file);
+    for (bool trans : {true, false}) {
+        detector.validation(raw, output_file, trans);
+        dataframe<double> output(output_file);
+        CHECK(output.column_num() == 4 && output.row_num() == raw.row_num());
+        if (output.column_num() != 4 || output.row_num() != raw.row_num())
+            continue;
+        for (unsigned long long int i = 0; i < raw.row_num(); ++i) {
+            std::vector<double> row{raw(0)[i], raw(1)[i]};
+            auto expected = detector.predict(row, trans);
+            CHECK(fabs(output(0)[i] - row[0]) <= 1e-5 * fabs(row[0]) && fabs(output(1)[i] - row[1]) <= 1e-5 * fabs(row[1]));
+            CHECK(output(2)[i] == expected.first);
+            // to_csv keeps six significant digits
+            CHECK(fabs(output(3)[i] - expected.second) <= 1e-5 * fabs(expected.second) + 1e-12);
+        }
+    }
+    std::remove(scaler_file);
+    std::remove(model_file);
+    std::remove(output_file);
+}
+
+// a moved svm_cxx keeps scoring like the original, and the const predict() overloads of one shared
+// instance give every thread the results of a sequential run (also run under -fsanitize=thread)
+static void test_concurrent_predict() {
+    node_set data(400, 3, 73, 3);
+    svm_cxx trained(3);
+    trained.param_init(C_SVC, RBF, 3, 0.5, 0, 0.5, 1, 1e-3, 10, 0.1, 1, 1);
+    trained.set_nr_thread(1);
+    trained.train(data.frame, data.y, 1);
+    auto expected = trained.predict(data.frame);
+
+    svm_cxx moved(std::move(trained));
+    CHECK(trained.sv_num() == 0);
+    svm_cxx assigned(3);
+    assigned.one_class_svm_param_init();
+    assigned.train(data.frame, {}, 1);
+    assigned = std::move(moved);
+    CHECK(moved.sv_num() == 0);
+    CHECK(assigned.predict(data.frame) == expected);
+
+    // every overload against its own sequential results: the svm_node path rounds differently
+    const svm_cxx &shared = assigned;
+    std::vector<std::pair<double, double>> node_expected, dense_expected;
+    std::vector<double> label_expected;
+    for (unsigned long long int i = 0; i < data.x.size(); ++i) {
+        node_expected.push_back(shared.predict(data.x[i]));
+        dense_expected.push_back(shared.predict(data.dense(int(i))));
+        label_expected.push_back(shared.predict_label(data.dense(int(i))));
+    }
+    std::vector<int> mismatch(4, 0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < 4; ++t)
+        threads.emplace_back([&, t]() {
+            for (int round = 0; round < 3; ++round)
+                for (unsigned long long int i = t; i < data.x.size(); ++i) {
+                    auto row = data.dense(int(i));
+                    if (shared.predict(data.x[i]) != node_expected[i] || shared.predict(row) != dense_expected[i] ||
+                        shared.predict_label(row) != label_expected[i])
+                        ++mismatch[t];
+                }
+            if (shared.predict(data.frame) != expected || shared.predict_batch(data.frame) != expected)
+                ++mismatch[t];
+        });
+    for (auto &thread : threads)
+        thread.join();
+    for (int t = 0; t < 4; ++t)
+        CHECK(mismatch[t] == 0);
+}
+
+// the fields svm_parameter adds to upstream libsvm are range checked
+static void test_check_parameter() {
+    node_set data(50, 2, 71, 2);
+    svm_problem prob = data.problem();
+    svm_parameter param = rbf_param(C_SVC);
+    CHECK(svm_check_parameter(&prob, &param) == nullptr);
+    for (int nr_thread : {-1, SVM_MAX_THREAD + 1, 1 << 30}) {
+        param.nr_thread = nr_thread;
+        CHECK(svm_check_parameter(&prob, &param) != nullptr);
+    }
+    param.nr_thread = SVM_MAX_THREAD;
+    CHECK(svm_check_parameter(&prob, &param) == nullptr);
+    for (int shared_cache : {-1, 2}) {
+        param.shared_cache = shared_cache;
+        CHECK(svm_check_parameter(&prob, &param) != nullptr);
+    }
+    param.shared_cache = 1;
+    CHECK(svm_check_parameter(&prob, &param) == nullptr);
+}
+
+// one-vs-one pairs solved concurrently or on a shared kernel cache must give the bit-identical model
+// of the sequential solve
+static void test_parallel_classification_training() {
+    node_set data(240, 3, 41, 4);
+    svm_problem prob = data.problem();
+    svm_parameter param = rbf_param(C_SVC);
+    param.nr_thread = 1;
+    svm_model *sequential = svm_train(&prob, &param);
+    for (int shared_cache : {0, 1}) {
+        param.nr_thread = 3;
+        param.shared_cache = shared_cache;
+        svm_model *model = svm_train(&prob, &param);
+        CHECK(model->l == sequential->l);
+        for (int p = 0; p < 6; ++p)
+            CHECK(model->rho[p] == sequential->rho[p]);
+        for (int c = 0; c < 3 && model->l == sequential->l; ++c)
+            for (int i = 0; i < model->l; ++i)
+                CHECK(model->sv_coef[c][i] == sequential->sv_coef[c][i]);
+        svm_free_and_destroy_model(&model);
+    }
+    svm_free_and_destroy_model(&sequential);
+}
+
+// every warm-started model of a nu path must be the model a cold svm_train finds at its nu, also
+// through svm_cxx::train_nu_path and select_path_model
+static void test_nu_path() {
+    node_set data(300, 2, 53);
+    svm_problem prob = data.problem();
+    svm_parameter param = rbf_param(ONE_CLASS);
+    std::vector<double> nu_list{0.05, 0.1, 0.3, 0.2, 0.5};
+    std::vector<svm_model *> path(nu_list.size(), nullptr);
+    CHECK(svm_train_one_class_path(&prob, &param, int(nu_list.size()), nu_list.data(), path.data()) == 0);
+
+    svm_cxx one_class_svm(2);
+    one_class_svm.param_init(ONE_CLASS, RBF, 3, param.gamma, 0, param.nu, 1, param.eps, param.cache_size);
+    CHECK(one_class_svm.train_nu_path(data.frame, nu_list) == 0);
+    CHECK(one_class_svm.path_model_num() == nu_list.size());
+    CHECK(one_class_svm.select_path_model(nu_list.size()) == -1);
+
+    for (unsigned long long int k = 0; k < nu_list.size(); ++k) {
+        param.nu = nu_list[k];
+        svm_model *cold = svm_train(&prob, &param);
+        CHECK(path[k] != nullptr && path[k]->param.nu == nu_list[k]);
+        CHECK(one_class_svm.select_path_model(k) == 0);
+        if (path[k] == nullptr) {
+            svm_free_and_destroy_model(&cold);
+            continue;
+        }
+        double tolerance = 1e-4 * std::fabs(cold->rho[0]);
+        CHECK(std::fabs(path[k]->rho[0] - cold->rho[0]) <= tolerance);
+        for (int i = 0; i < prob.l; ++i) {
+            double cold_dec, path_dec;
+            svm_predict_values(cold, data.x[i], &cold_dec);
+            svm_predict_values(path[k], data.x[i], &path_dec);
+            CHECK(std::fabs(path_dec - cold_dec) <= tolerance);
+            CHECK(std::fabs(one_class_svm.predict(data.dense(i)).second - cold_dec) <= tolerance);
+        }
+        svm_free_and_destroy_model(&cold);
+    }
+    for (auto &model : path)
+        svm_free_and_destroy_model(&model);
+}
+
+// once no left out row violates it, the cascade model solves the full problem: rho and the decision
+// values must match a single svm_train
+static void test_cascade() {
+    node_set data(600, 2, 47);
+    svm_problem prob = data.problem();
+    svm_parameter param = rbf_param(ONE_CLASS);
+    svm_model *full = svm_train(&prob, &param);
+
+    for (int nr_shard : {2, 5}) {
+        svm_cxx one_class_svm(2);
+        one_class_svm.param_init(ONE_CLASS, RBF, 3, param.gamma, 0, param.nu, 1, param.eps, param.cache_size);
+        double accuracy = one_class_svm.train_cascade(data.frame, nr_shard, 2);
+        CHECK(accuracy > 0);
+        const char *cascade_file = "svm_test.cascade.model";
+        CHECK(one_class_svm.save_model(cascade_file) == 0);
+        svm_model *cascade = svm_load_model(cascade_file);
+        std::remove(cascade_file);
+        CHECK(cascade != nullptr);
+        if (cascade == nullptr)
+            continue;
+        CHECK(std::fabs(cascade->rho[0] - full->rho[0]) <= 1e-4 * std::fabs(full->rho[0]));
+        for (int i = 0; i < prob.l; ++i) {
+            double full_dec, cascade_dec;
+            svm_predict_values(full, data.x[i], &full_dec);
+            svm_predict_values(cascade, data.x[i], &cascade_dec);
+            CHECK(std::fabs(cascade_dec - full_dec) <= 1e-4 * std::fabs(full->rho[0]));
+            CHECK(one_class_svm.predict(data.x[i]).first == svm_predict(full, data.x[i]) ||
+                  std::fabs(full_dec) <= 1e-4 * std::fabs(full->rho[0]));
+        }
+        svm_free_and_destroy_model(&cascade);
+    }
+    svm_free_and_destroy_model(&full);
+}
+
+// ball tree pruning stays within its reported bound, the fast Gauss transform within its tolerance
+static void test_approximate_prediction() {
+    node_set data(2000, 2, 43);
+    svm_problem prob = data.problem();
+    // a narrow kernel lets the ball tree prune, a wide one makes the expansion cheaper than exact summation
+    for (double gamma : {2.0, 0.05}) {
+        svm_parameter param = rbf_param(ONE_CLASS);
+        param.gamma = gamma;
+        param.nu = 0.5;
+        svm_model *model = svm_train(&prob, &param);
+        svm_ball_tree *tree = svm_build_ball_tree(model, 1e-3);
+        svm_fgt *fgt = svm_build_fgt(model, 1e-3);
+        CHECK(tree != nullptr);
+        CHECK(gamma > 1 || fgt != nullptr);
+
+        std::vector<double> label;
+        auto exact = exact_decision_values(model, data, label);
+        double max_bound = 0;
+        for (int i = 0; i < prob.l && tree != nullptr; ++i) {
+            auto row = data.dense(i);
+            double dec_value, error_bound;
+            svm_ball_tree_predict_values(tree, row.data(), 2, &dec_value, &error_bound);
+            CHECK(error_bound >= 0);
+            CHECK(fabs(dec_value - exact[i][0]) <= error_bound + rounding_tolerance(model, data.x[i]));
+            max_bound = std::max(max_bound, error_bound);
+            if (fgt != nullptr) {
+                svm_fgt_predict_values(fgt, row.data(), 2, &dec_value, nullptr);
+                CHECK(fabs(dec_value - exact[i][0]) <= 1e-3);
+            }
+        }
+        CHECK(gamma < 1 || max_bound > 0);
+        svm_free_fgt(&fgt);
+        svm_free_ball_tree(&tree);
+        svm_free_and_destroy_model(&model);
+    }
+}
+
+// compress must keep to its support vector budget and report the change of the decision values that
+// the models before and after it actually show
+static void test_compress() {
+    for (int svm_type : {ONE_CLASS, EPSILON_SVR}) {
+        node_set data(400, 2, 59);
+        node_set validation(200, 2, 61);
+        if (svm_type == EPSILON_SVR)
+            data.set_regression();
+        svm_cxx svm(2);
+        svm.param_init(svm_type, RBF, 3, 0.5, 0, 0.3, 1, 1e-3, 10, 0.01);
+        svm.train(data.frame, data.y, 1);
+        int budget = 15;
+        CHECK(svm.sv_num() > budget);
+        std::vector<double> before(validation.x.size());
+        for (unsigned long long int i = 0; i < before.size(); ++i)
+            before[i] = svm.predict(validation.dense(int(i))).second;
+
+        auto report = svm.compress(budget, validation.frame);
+        CHECK(report.sv_num > 0 && report.sv_num <= budget);
+        CHECK(svm.sv_num() == report.sv_num);
+        CHECK(report.row_num == (long long int) before.size());
+        double rms_error = 0, max_error = 0;
+        int agree = 0;
+        for (unsigned long long int i = 0; i < before.size(); ++i) {
+            double after = svm.predict(validation.dense(int(i))).second;
+            rms_error += (after - before[i]) * (after - before[i]);
+            max_error = std::max(max_error, fabs(after - before[i]));
+            if ((after > 0) == (before[i] > 0))
+                ++agree;
+        }
+        rms_error = sqrt(rms_error / double(before.size()));
+        CHECK(fabs(report.rms_error - rms_error) <= 1e-9);
+        CHECK(fabs(report.max_error - max_error) <= 1e-9);
+        if (svm_type == ONE_CLASS)
+            CHECK(fabs(report.label_agreement - 100.0 * agree / double(before.size())) <= 1e-9);
+        else
+            CHECK(report.label_agreement == -1);
+
+        // within budget already: nothing changes
+        report = svm.compress(budget, validation.frame);
+        CHECK(report.sv_num == svm.sv_num() && report.rms_error == 0);
+    }
+    svm_cxx classifier(2);
+    node_set data(100, 2, 67, 2);
+    classifier.param_init(C_SVC, RBF, 3, 0.5);
+    classifier.train(data.frame, data.y, 1);
+    CHECK(classifier.compress(5, data.frame).sv_num == -1);
+}
+
+// quantized models: a label may only differ where the exact decision value is within
+// the decision error, and the calibration report must see the same error
+static void test_quantized_model() {
+    for (int precision : {QUANT_INT8, QUANT_FP16}) {
+        node_set data(400, 8, 47, 3);
+        svm_cxx svm(8);
+        svm.param_init(C_SVC, RBF, 3, 0.1, 0, 0.5, 1, 1e-6, 10);
+        svm.train(data.frame, data.y, 1);
+        CHECK(svm.set_quantization(precision) == 0);
+        auto report = svm.calibrate_quantization(data.frame);
+
+        svm_problem prob = data.problem();
+        svm_parameter param = rbf_param(C_SVC);
+        param.gamma = 0.1;
+        svm_model *model = svm_train(&prob, &param);
+        svm_quantized_model *quantized = svm_quantize_model(model, precision);
+        std::vector<double> label;
+        auto exact = exact_decision_values(model, data, label);
+        std::vector<double> dec(exact[0].size());
+        double max_error = 0;
+        int agree = 0;
+        for (int i = 0; i < prob.l; ++i) {
+            auto row = data.dense(i);
+            double quantized_label = svm_quantized_predict_values(quantized, row.data(), 8, dec.data(), nullptr);
+            double error = 0;
+            for (unsigned long long int p = 0; p < dec.size(); ++p)
+                error = std::max(error, fabs(dec[p] - exact[i][p]));
+            max_error = std::max(max_error, error);
+            if (quantized_label == label[i])
+                ++agree;
+            else
+                CHECK(near_tie(exact[i], error));
+        }
+        CHECK(max_error < (precision == QUANT_FP16 ? 1e-2 : 1e-1));
+        CHECK(fabs(report.max_error - max_error) <= 1e-12);
+        CHECK(fabs(report.label_agreement - 100.0 * agree / prob.l) <= 1e-9);
+        CHECK(report.label_agreement >= 99);
+        svm_free_quantized_model(&quantized);
+        svm_free_and_destroy_model(&model);
+    }
+}
+
+// compiled probability prediction, one row and in batches, against svm_predict_probability
+static void test_compiled_probability() {
+    node_set data(300, 3, 53, 3);
+    svm_parameter param = rbf_param(C_SVC);
+    param.probability = 1;
+    svm_problem prob = data.problem();
+    svm_model *model = svm_train(&prob, &param);
+    svm_compiled_model *compiled = svm_compile_model(model);
+    svm_workspace *ws = svm_create_workspace();
+
+    std::vector<double> rows, labels(prob.l), batch_prob(3 * prob.l);
+    for (int i = 0; i < prob.l; ++i) {
+        auto row = data.dense(i);
+        rows.insert(rows.end(), row.begin(), row.end());
+    }
+    svm_compiled_predict_probability_batch(compiled, rows.data(), prob.l, 3, labels.data(), batch_prob.data(), ws);
+    double exact[3], single[3];
+    for (int i = 0; i < prob.l; ++i) {
+        double label = svm_predict_probability(model, prob.x[i], exact);
+        double single_label = svm_compiled_predict_probability(compiled, &rows[3 * i], 3, single, ws);
+        CHECK(single_label == labels[i]);
+        for (int c = 0; c < 3; ++c) {
+            CHECK(single[c] == batch_prob[3 * i + c]);
+            CHECK(fabs(single[c] - exact[c]) <= 1e-9);
+        }
+        if (std::max({exact[0], exact[1], exact[2]}) - std::min({exact[0], exact[1], exact[2]}) > 1e-6)
+            CHECK(single_label == label);
+    }
+    svm_destroy_workspace(ws);
+    svm_free_compiled_model(&compiled);
+    svm_free_and_destroy_model(&model);
+}
+
+int main() {
+    svm_set_print_string_function(print_null);
+
+    test_loo_estimate(ONE_CLASS, 0.05);
+    test_loo_estimate(ONE_CLASS, 0.2);
+    test_loo_estimate(ONE_CLASS, 0.5);
+    test_loo_estimate(C_SVC, 0.1);
+    test_train_validation_probability();
+    test_cross_validation_after_train();
+    test_checkpoint_of_other_data();
+    test_checkpoint_resume_after_kill();
+    test_foreign_checkpoint_file_kept();
+    test_prefetch();
+    test_bulk_trainer();
+    test_scaled_model_large_offset();
+    test_compiled_model();
+    test_batch_prediction();
+    test_detection_validation();
+    test_concurrent_predict();
+    test_check_parameter();
+    test_parallel_classification_training();
+    test_nu_path();
+    test_cascade();
+    test_approximate_prediction();
+    test_compress();
+    test_quantized_model();
+    test_compiled_probability();
+
+    if (nr_failure == 0)
+        std::printf("All tests passed\n");
+    return nr_failure == 0 ? 0 : 1;
+}